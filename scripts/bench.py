@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+"""End-to-end scaling benchmark of flatctr.
+
+Runs flatctr over a grid of train thread nums, embedding dims and batch sizes, and reports
+throughput, scaling efficiency relative to the smallest thread num, peak RSS and AUC.
+
+    ./flatctr_gen -o train.txt -n 10000000 && ./flatctr_gen -o valid.txt -n 1000000 --seed 2
+    ../scripts/bench.py --train train.txt --valid valid.txt -m fm --tt 1,2,4,8 -k 4,8 -b 64
+"""
+
+import argparse
+import csv
+import itertools
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+RE_EPOCH = re.compile(r"epoch\s+\d+, trained on (\d+) samples, costs ([\d.]+) secs")
+RE_AUC = re.compile(r"AUC: ([\d.naif-]+)")
+
+
+def int_list(s):
+    return [int(x) for x in s.split(",") if x]
+
+
+def run_one(args, tt, k, b):
+    cmd = [args.flatctr, "-m", args.model, "--train", args.train, "--valid", args.valid,
+           "--test", "", "-o", "", "-e", str(args.epoch), "--tt", str(tt), "-k", str(k),
+           "-b", str(b)] + args.extra
+    with tempfile.TemporaryFile(mode="w+") as log:
+        proc = subprocess.Popen(cmd, stdout=log, stderr=subprocess.STDOUT)
+        _, status, rusage = os.wait4(proc.pid, 0)
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        log.seek(0)
+        output = log.read()
+    if proc.returncode != 0:
+        sys.stderr.write(output)
+        raise RuntimeError("flatctr failed: " + " ".join(cmd))
+
+    samples, secs = 0, 0.0
+    for n, t in RE_EPOCH.findall(output):
+        samples += int(n)
+        secs += float(t)
+    aucs = RE_AUC.findall(output)
+    return {
+        "model": args.model,
+        "tt": tt,
+        "k": k,
+        "batch_size": b,
+        "samples": samples,
+        "train_secs": round(secs, 4),
+        "throughput": round(samples / secs, 1) if secs > 0 else 0.0,
+        "peak_rss_mb": round(rusage.ru_maxrss / 1024, 1),  # ru_maxrss is in KB on linux
+        "auc": float(aucs[-1]) if aucs else float("nan"),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--flatctr", default="./flatctr", help="path of flatctr binary")
+    parser.add_argument("--train", required=True, help="training file")
+    parser.add_argument("--valid", default="", help="validation file, for AUC")
+    parser.add_argument("-m", "--model", default="fm", help="lr or fm")
+    parser.add_argument("-e", "--epoch", type=int, default=1, help="num of epochs")
+    parser.add_argument("--tt", type=int_list, default=[1, 2, 4, 8], help="train thread nums")
+    parser.add_argument("-k", type=int_list, default=[4], help="dims of embedding")
+    parser.add_argument("-b", type=int_list, default=[64], help="batch sizes")
+    parser.add_argument("--repeat", type=int, default=1, help="runs per config, best is kept")
+    parser.add_argument("--csv", default="", help="file to save results as csv")
+    parser.add_argument("--json", default="", help="file to save results as json")
+    parser.add_argument("extra", nargs="*", help="extra args passed to flatctr after --")
+    args = parser.parse_args()
+
+    results = []
+    for k, b, tt in itertools.product(args.k, args.b, sorted(args.tt)):
+        runs = [run_one(args, tt, k, b) for _ in range(args.repeat)]
+        best = max(runs, key=lambda r: r["throughput"])
+        base = next((r for r in results if r["k"] == k and r["batch_size"] == b), best)
+        best["efficiency"] = round(
+            best["throughput"] * base["tt"] / (base["throughput"] * tt), 3
+        ) if base["throughput"] > 0 else 0.0
+        results.append(best)
+        print("model={model} tt={tt:<3d} k={k:<3d} b={batch_size:<5d} "
+              "throughput={throughput:>12.1f}/s efficiency={efficiency:.3f} "
+              "peak_rss={peak_rss_mb:.1f}MB auc={auc:.6f}".format(**best), flush=True)
+
+    if args.csv:
+        with open(args.csv, "w", newline="") as f:
+            writer = csv.DictWriter(f, fieldnames=list(results[0].keys()))
+            writer.writeheader()
+            writer.writerows(results)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(results, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
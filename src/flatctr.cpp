@@ -1,4 +1,5 @@
 #include <chrono>
+#include <cstdio>
 #include <fstream>
 #include <iomanip>
 #include <pthread.h>
@@ -7,12 +8,21 @@
 #include "cxxopts.hpp"
 #include "spdlog/spdlog.h"
 
+#include "worker/barrier.h"
 #include "worker/blocking_queue.h"
 #include "common.h"
 #include "dataset/parser.h"
+#include "dataset/sample_cache.h"
+#include "dist/ps_model.h"
+#include "dist/ps_server.h"
+#include "hash_rng.h"
 #include "metric.h"
 #include "model/lr_model.h"
 #include "model/fm_model.h"
+#include "model/sharded_model.h"
+#include "stats.h"
+#include "trace.h"
+#include "worker/numa.h"
 
 using namespace std;
 
@@ -39,6 +49,40 @@ struct Config
   uint32_t train_thread_num;
   long     seed;
   bool     debug;
+  double   stats_interval;
+  string   stats_file;
+  string   trace_file;
+  double   max_model_mem;
+  string   mem_policy;
+  string   role;
+  string   ps;
+  uint32_t ps_id;
+  uint32_t worker_id;
+  uint32_t num_workers;
+  bool     numa;
+  bool     sharded;
+  uint32_t package_size;
+  uint32_t queue_depth;
+  bool     autotune;
+  uint32_t autotune_rows;
+  double   autotune_auc_tol;
+  string   autotune_save;
+  bool     deterministic;
+  uint32_t round_batches;
+  uint32_t early_stop;
+  double   valid_sample;
+  uint32_t hot_rows;
+  uint32_t hot_scan;
+  string   vocab;
+  bool     build_vocab;
+  uint32_t min_count;
+  string   sweep;
+  double   neg_sample_rate;
+  bool     cache_in_memory;
+  bool     shuffle;
+  bool     direct_io;
+
+  vector<string> ps_servers;
 
   [[nodiscard]] string str() const
   {
@@ -62,16 +106,79 @@ struct Config
     sprintf(ss + strlen(ss), "%*s: %u\n", padding, "train_thread_num", train_thread_num);
     sprintf(ss + strlen(ss), "%*s: %ld\n", padding, "seed", seed);
     sprintf(ss + strlen(ss), "%*s: %d\n", padding, "debug", debug);
+    sprintf(ss + strlen(ss), "%*s: %.9g\n", padding, "stats_interval", stats_interval);
+    sprintf(ss + strlen(ss), "%*s: %s\n", padding, "stats_file", stats_file.c_str());
+    sprintf(ss + strlen(ss), "%*s: %s\n", padding, "trace_file", trace_file.c_str());
+    sprintf(ss + strlen(ss), "%*s: %.9g\n", padding, "max_model_mem", max_model_mem);
+    sprintf(ss + strlen(ss), "%*s: %s\n", padding, "mem_policy", mem_policy.c_str());
+    sprintf(ss + strlen(ss), "%*s: %s\n", padding, "role", role.c_str());
+    sprintf(ss + strlen(ss), "%*s: %s\n", padding, "ps", ps.c_str());
+    sprintf(ss + strlen(ss), "%*s: %u\n", padding, "ps_id", ps_id);
+    sprintf(ss + strlen(ss), "%*s: %u\n", padding, "worker_id", worker_id);
+    sprintf(ss + strlen(ss), "%*s: %u\n", padding, "num_workers", num_workers);
+    sprintf(ss + strlen(ss), "%*s: %d\n", padding, "numa", numa);
+    sprintf(ss + strlen(ss), "%*s: %d\n", padding, "sharded", sharded);
+    sprintf(ss + strlen(ss), "%*s: %u\n", padding, "package_size", package_size);
+    sprintf(ss + strlen(ss), "%*s: %u\n", padding, "queue_depth", queue_depth);
+    sprintf(ss + strlen(ss), "%*s: %d\n", padding, "autotune", autotune);
+    sprintf(ss + strlen(ss), "%*s: %u\n", padding, "autotune_rows", autotune_rows);
+    sprintf(ss + strlen(ss), "%*s: %.9g\n", padding, "autotune_auc_tol", autotune_auc_tol);
+    sprintf(ss + strlen(ss), "%*s: %s\n", padding, "autotune_save", autotune_save.c_str());
+    sprintf(ss + strlen(ss), "%*s: %d\n", padding, "deterministic", deterministic);
+    sprintf(ss + strlen(ss), "%*s: %u\n", padding, "round_batches", round_batches);
+    sprintf(ss + strlen(ss), "%*s: %u\n", padding, "early_stop", early_stop);
+    sprintf(ss + strlen(ss), "%*s: %.9g\n", padding, "valid_sample", valid_sample);
+    sprintf(ss + strlen(ss), "%*s: %u\n", padding, "hot_rows", hot_rows);
+    sprintf(ss + strlen(ss), "%*s: %u\n", padding, "hot_scan", hot_scan);
+    sprintf(ss + strlen(ss), "%*s: %s\n", padding, "vocab", vocab.c_str());
+    sprintf(ss + strlen(ss), "%*s: %d\n", padding, "build_vocab", build_vocab);
+    sprintf(ss + strlen(ss), "%*s: %u\n", padding, "min_count", min_count);
+    sprintf(ss + strlen(ss), "%*s: %s\n", padding, "sweep", sweep.c_str());
+    sprintf(ss + strlen(ss), "%*s: %.9g\n", padding, "neg_sample_rate", neg_sample_rate);
+    sprintf(ss + strlen(ss), "%*s: %d\n", padding, "cache_in_memory", cache_in_memory);
+    sprintf(ss + strlen(ss), "%*s: %d\n", padding, "shuffle", shuffle);
+    sprintf(ss + strlen(ss), "%*s: %d\n", padding, "direct_io", direct_io);
 
     return ss;
   }
 } cfg;
 
-void train_thread(const int id, Base* model,
-                  BlockingQueue<unique_ptr<vector<unique_ptr<string>>>>& line_queue)
+unique_ptr<Vocab> vocab; // maps feature ids of samples to dense ids if set
+vector<Config>    sweep; // configs of models trained together by --sweep, cfg alone if empty
+
+// Negatives are kept at neg_sample_rate, by a hash of key and epoch, so runs drop the same ones. Key
+// is the line no of training file, or the row of the cache once samples are cached.
+bool drop_negative(bool negative, uint64_t key, size_t epoch_i)
+{
+  return cfg.neg_sample_rate < 1 && negative
+         && mix64(key ^ (uint64_t)epoch_i << 48) >= (uint64_t)(cfg.neg_sample_rate * 0x1p64);
+}
+
+// only the label, the first byte, is read, the line is not parsed
+bool drop_negative(const string& line, uint64_t line_no, size_t epoch_i)
 {
+  return drop_negative(!line.empty() && line[0] == '0', line_no, epoch_i);
+}
+
+// Trains models on packages of line_queue, each batch is parsed once and learned by all models.
+// Parsed samples are kept in cache if given, all of them, negatives are then dropped here rather
+// than by the reader so that each epoch drops its own.
+void train_thread(const int id, const vector<Base*>& models,
+                  BlockingQueue<unique_ptr<vector<unique_ptr<string>>>>& line_queue,
+                  SampleCache* cache, size_t epoch_i, atomic<size_t>& n_dropped)
+{
+  stringstream ss;
+  ss << "train_" << std::setfill('0') << std::setw(2) << id;
+  Stats::set_thread_name(ss.str());
+  Trace::set_thread_name(ss.str());
+  Numa::interleave_thread();
+  for (Base* model : models)
+    model->thread_begin(id);
+
   vector<unique_ptr<Sample>> samples;
   samples.reserve(cfg.batch_size);
+  unique_ptr<SampleChunk> chunk = cache != nullptr ? cache->new_chunk() : nullptr;
+  size_t                  n_bad = 0, n_drop = 0;
   while (true)
   {
     unique_ptr<vector<unique_ptr<string>>> lines;
@@ -80,31 +187,740 @@ void train_thread(const int id, Base* model,
     {
       break;
     }
-    for (size_t i = 0; i < lines->size(); i++)
+    // batches are filled up to batch_size whatever negatives are dropped
+    for (size_t i = 0; i < lines->size();)
     {
-      unique_ptr<Sample> sample = make_unique<Sample>(*(lines->at(i)));
-      if (cfg.debug) [[unlikely]]
-        spdlog::debug("{}: SAMPLE\t {}", id, sample->to_string());
-      samples.push_back(std::move(sample));
-      if (samples.size() == cfg.batch_size || i == lines->size() - 1)
+      size_t nnz = 0;
       {
-        model->learn(samples);
-        samples.clear();
+        StatTimer timer(Stats::PARSE_NS);
+        TraceSpan span("parse");
+        for (; i < lines->size() && samples.size() < cfg.batch_size; i++)
+        {
+          unique_ptr<Sample> sample = Sample::parse(*(lines->at(i)), vocab.get());
+          if (sample == nullptr) [[unlikely]]
+          {
+            if (n_bad++ == 0)
+              spdlog::warn("{}: skip malformed line [{}]", id, *(lines->at(i)));
+            Stats::add(Stats::BAD_LINES, 1);
+            continue;
+          }
+          if (cfg.debug) [[unlikely]]
+            spdlog::debug("{}: SAMPLE\t {}", id, sample->to_string());
+          if (cache != nullptr)
+          {
+            chunk->add(*sample);
+            bool drop = drop_negative(sample->y == 0, chunk->key(chunk->rows() - 1), epoch_i);
+            if (chunk->full())
+            {
+              cache->add(std::move(chunk));
+              chunk = cache->new_chunk();
+            }
+            if (drop)
+            {
+              n_drop++;
+              continue;
+            }
+          }
+          nnz += sample->x->size();
+          samples.push_back(std::move(sample));
+        }
+      }
+      {
+        StatTimer timer(Stats::LEARN_NS);
+        TraceSpan span("learn");
+        for (Base* model : models)
+          model->learn(samples);
       }
+      Stats::add(Stats::SAMPLES, samples.size());
+      Stats::add(Stats::NNZ, nnz);
+      samples.clear();
     }
   }
+  if (cache != nullptr)
+    cache->add(std::move(chunk));
+  n_dropped += n_drop;
+  for (Base* model : models)
+    model->thread_end();
+  if (n_bad > 0)
+    spdlog::warn("train thread {}: {} malformed lines skipped", id, n_bad);
   if (cfg.debug)
     spdlog::debug("train thread {:4d} end", id);
 }
 
+void log_mem(Base* model)
+{
+  MemInfo info = model->mem_info();
+  spdlog::info("memory: {} rows, {:.1f} bytes/row, table {:.1f}MB (load factor {:.3f}), model "
+               "{:.1f}MB, parser buffers {:.1f}MB, rss {:.1f}MB, peak rss {:.1f}MB",
+               info.rows, info.bytes_per_row(), info.table_bytes / MB, info.load_factor,
+               info.bytes() / MB, Parser::live_buffer_bytes / MB, rss_bytes() / MB,
+               peak_rss_bytes() / MB);
+  if (info.hot_rows > 0)
+    spdlog::info("memory: {} hot rows, {:.1f}MB", info.hot_rows, info.hot_bytes / MB);
+}
+
+// checks memory budget of model store, and evicts rows under evict policy
+void enforce_mem_budget(Base* model)
+{
+  size_t n = model->check_mem();
+  if (n == 0 || cfg.mem_policy != "evict")
+    return;
+  TraceSpan span("evict");
+  size_t    evicted = model->evict(n);
+  model->check_mem();
+  spdlog::info("memory budget {:.1f}MB reached, evicted {} rows", cfg.max_model_mem, evicted);
+}
+
+Base* make_model(const Config& c = cfg)
+{
+  if (c.sharded)
+    return new ShardedModel(c.model == "lr" ? 0 : c.k, c.train_thread_num, c.w_lr, c.v_lr, c.w_l2,
+                            c.v_l2, c.v_stddev, c.seed);
+  Base* model;
+  if (c.model == "lr")
+    model = new LR(c.w_lr, c.w_l2);
+  else
+    model = new FM(c.k, c.w_lr, c.v_lr, c.w_l2, c.v_l2, c.v_stddev, c.seed);
+  if (vocab != nullptr)
+    model->set_dense_rows(vocab->rows());
+  model->set_neg_sample_rate(c.neg_sample_rate);
+  return model;
+}
+
+// k of fm model file fname, 0 if it is not one
+uint32_t model_k(const string& fname)
+{
+  ifstream ifs(fname);
+  string   key;
+  double   neg_rate;
+  uint32_t k = 0;
+  if ((ifs >> key) && (key != "neg_sample_rate" || (ifs >> neg_rate >> key)) && key == "k")
+    ifs >> k;
+  return k;
+}
+
+// returns the hot_rows most frequent feature ids on the first hot_scan lines of training file
+vector<uint32_t> find_hot_ids()
+{
+  TraceSpan                         span("hot_scan");
+  Clock                             t_begin = Time::now();
+  Parser                            parser(cfg.train_file);
+  unordered_map<uint32_t, uint32_t> counts;
+  SampleX                           x;
+  uint32_t                          y;
+  size_t                            n_lines = 0, n_occurs = 0;
+  for (; n_lines < cfg.hot_scan; n_lines++)
+  {
+    unique_ptr<string> line = parser.nextLine();
+    if (line == nullptr)
+      break;
+    if (!Tokenizer::parse_line(line->data(), line->data() + line->size(), y, x))
+      continue;
+    for (auto& [i, xi] : x)
+      counts[i]++;
+    n_occurs += x.size();
+  }
+
+  vector<pair<uint32_t, uint32_t>> by_count; // (count, id)
+  by_count.reserve(counts.size());
+  for (auto& [id, count] : counts)
+    by_count.emplace_back(count, id);
+  size_t n = min<size_t>(cfg.hot_rows, by_count.size());
+  nth_element(by_count.begin(), by_count.begin() + n, by_count.end(), greater<>());
+  vector<uint32_t> ids;
+  size_t           n_covered = 0;
+  for (size_t k = 0; k < n; k++)
+  {
+    ids.push_back(by_count[k].second);
+    n_covered += by_count[k].first;
+  }
+  chrono::duration<float> cost = Time::now() - t_begin;
+  spdlog::info("hot rows: {} ids of {} cover {:.1f}% of features on {} lines, costs {:.4f} secs",
+               ids.size(), counts.size(), n_occurs ? 100.0 * n_covered / n_occurs : 0.0, n_lines,
+               cost.count());
+  return ids;
+}
+
+// ids occurring at least min_count times in training file, most frequent first
+void build_vocab()
+{
+  TraceSpan                         span("vocab");
+  Clock                             t_begin = Time::now();
+  Parser                            parser(cfg.train_file);
+  unordered_map<uint32_t, uint32_t> counts;
+  SampleX                           x;
+  uint32_t                          y;
+  while (true)
+  {
+    unique_ptr<string> line = parser.nextLine();
+    if (line == nullptr)
+      break;
+    if (!Tokenizer::parse_line(line->data(), line->data() + line->size(), y, x))
+      continue;
+    for (auto& [i, xi] : x)
+      counts[i]++;
+  }
+
+  vector<pair<uint32_t, uint32_t>> by_count; // (count, id)
+  for (auto& [id, count] : counts)
+    if (count >= cfg.min_count)
+      by_count.emplace_back(count, id);
+  sort(by_count.begin(), by_count.end(), [](auto& a, auto& b) {
+    return a.first != b.first ? a.first > b.first : a.second < b.second;
+  });
+  vector<uint32_t> ids;
+  ids.reserve(by_count.size());
+  for (auto& [count, id] : by_count)
+    ids.push_back(id);
+  vocab = make_unique<Vocab>();
+  vocab->build(std::move(ids));
+  chrono::duration<float> cost = Time::now() - t_begin;
+  spdlog::info("vocab: {} of {} ids occur at least {} times, costs {:.4f} secs", vocab->rows() - 1,
+               counts.size(), cfg.min_count, cost.count());
+}
+
+// Predicts samples of file in batches by each of models, calls fn(m, pred, sample) for model m of
+// each sample. Malformed lines are skipped, or predicted as rows without features if
+// keep_malformed, so output lines up with input. If sample_rate < 1, only lines whose hashed line
+// no falls below it are read, the same every call.
+template <typename Fn>
+void predict_file(const vector<Base*>& models, const string& file_name, bool keep_malformed,
+                  double sample_rate, Fn fn)
+{
+  Parser                     parser(file_name);
+  vector<unique_ptr<Sample>> samples;
+  vector<F>                  preds;
+  size_t                     n_bad = 0, line_no = 0;
+  uint64_t                   limit = sample_rate < 1 ? (uint64_t)(sample_rate * 0x1p64) : 0;
+  while (true)
+  {
+    samples.clear();
+    while (samples.size() < 4096)
+    {
+      unique_ptr<string> line = parser.nextLine();
+      if (line == nullptr)
+        break;
+      if (sample_rate < 1 && mix64(line_no++) >= limit)
+        continue;
+      unique_ptr<Sample> sample = Sample::parse(*line, vocab.get());
+      if (sample == nullptr) [[unlikely]]
+      {
+        n_bad++;
+        if (!keep_malformed)
+          continue;
+        sample = make_unique<Sample>(0, make_unique<SampleX>());
+      }
+      samples.push_back(std::move(sample));
+    }
+    if (samples.empty())
+      break;
+    for (size_t m = 0; m < models.size(); m++)
+    {
+      models[m]->predict_batch(samples, preds);
+      for (size_t i = 0; i < samples.size(); i++)
+        fn(m, preds[i], samples[i]);
+    }
+  }
+  if (n_bad > 0)
+    spdlog::warn("{}: {} malformed lines {}", file_name, n_bad,
+                 keep_malformed ? "predicted without features" : "skipped");
+}
+
+// returns AUC of each of models on valid_file, on a fixed subsample of its lines if sample_rate < 1
+vector<double> validate(const vector<Base*>& models, double sample_rate)
+{
+  TraceSpan           span("validation");
+  Clock               t_begin = Time::now();
+  vector<vector<F>>   y_pred(models.size());
+  vector<vector<int>> y_true(models.size());
+  predict_file(models, cfg.valid_file, false, sample_rate,
+               [&](size_t m, F pred, const unique_ptr<Sample>& sample) {
+                 y_pred[m].emplace_back(pred);
+                 y_true[m].emplace_back(sample->y);
+                 if (cfg.debug)
+                   spdlog::debug("PRED {:.4f} {}", pred, sample->y);
+               });
+  vector<double>          aucs;
+  chrono::duration<float> cost = Time::now() - t_begin;
+  for (size_t m = 0; m < models.size(); m++)
+  {
+    aucs.push_back(calc_auc(y_pred[m], y_true[m]));
+    spdlog::info("{}{}, {} samples{}, AUC: {:.6f}, costs {:.4f} secs",
+                 models.size() > 1 ? fmt::format("model {}: ", m) : "", cfg.valid_file,
+                 y_pred[m].size(), sample_rate < 1 ? " sampled" : "", aucs[m], cost.count());
+  }
+  return aucs;
+}
+
+void save_model(Base* model, const string& fname)
+{
+  TraceSpan span("save");
+  Clock     t_begin = Time::now();
+  spdlog::info("**************** save model ****************");
+  spdlog::info("save to {}", fname);
+  model->save(fname);
+  // a stale vocab would be loaded with the model as if it was trained on dense ids
+  if (vocab != nullptr)
+    vocab->save(fname + ".vocab");
+  else
+    std::remove((fname + ".vocab").c_str());
+  chrono::duration<float> cost = Time::now() - t_begin;
+  spdlog::info("finish, costs {:.4f} secs", cost.count());
+}
+
 size_t get_package_size(size_t batch_size)
 {
+  if (cfg.package_size > 0)
+    return cfg.package_size;
   size_t package_size = batch_size;
   while (package_size < 2048)
     package_size *= 2;
   return package_size;
 }
 
+size_t get_queue_depth()
+{
+  return cfg.queue_depth > 0 ? cfg.queue_depth : cfg.train_thread_num * 2;
+}
+
+// Deterministic training in rounds of round_batches batches. Gradients of all batches of a round
+// are computed against the weights at the start of the round, batch b by train thread
+// b % train_thread_num, then applied in batch order, each thread applying its own buckets of ids.
+// Updates of an id happen in the same order whatever the num of threads, so the model is
+// bit-identical. The reader fills the next round meanwhile.
+template <typename NextLine>
+size_t train_pass_deterministic(Base* model, NextLine next_line, size_t epoch_i, bool verbose)
+{
+  size_t                     n_threads = cfg.train_thread_num;
+  size_t                     n_sample = 0, step = 1000000;
+  size_t                     round_size = (size_t)cfg.round_batches * cfg.batch_size;
+  size_t                     line_no    = 0;
+  vector<unique_ptr<string>> round, next_round;
+  vector<GradBuffer>         grads(cfg.round_batches);
+  Barrier                    barrier(n_threads + 1);
+
+  auto read_round = [&](vector<unique_ptr<string>>& lines) {
+    TraceSpan span("split");
+    lines.clear();
+    while (lines.size() < round_size)
+    {
+      unique_ptr<string> line = next_line();
+      if (line == nullptr)
+        break;
+      uint64_t no = line_no++;
+      if ((cfg.num_workers > 1 && no % cfg.num_workers != cfg.worker_id)
+          || drop_negative(*line, no, epoch_i))
+        continue;
+      lines.push_back(std::move(line));
+    }
+    Stats::add(Stats::LINES, lines.size());
+  };
+
+  auto work = [&](size_t id) {
+    stringstream ss;
+    ss << "train_" << std::setfill('0') << std::setw(2) << id;
+    Stats::set_thread_name(ss.str());
+    Trace::set_thread_name(ss.str());
+    Numa::interleave_thread();
+
+    vector<unique_ptr<Sample>> samples;
+    while (true)
+    {
+      barrier.wait(); // round is ready
+      if (round.empty())
+        break;
+      size_t n_batches = (round.size() + cfg.batch_size - 1) / cfg.batch_size;
+      for (size_t b = id; b < n_batches; b += n_threads)
+      {
+        samples.clear();
+        size_t nnz = 0;
+        for (size_t i = b * cfg.batch_size; i < min(round.size(), (b + 1) * cfg.batch_size); i++)
+        {
+          unique_ptr<Sample> sample = Sample::parse(*round[i], vocab.get());
+          if (sample == nullptr) [[unlikely]]
+          {
+            Stats::add(Stats::BAD_LINES, 1);
+            continue;
+          }
+          nnz += sample->x->size();
+          samples.push_back(std::move(sample));
+        }
+        StatTimer timer(Stats::LEARN_NS);
+        TraceSpan span("grad");
+        model->compute_grad(samples, grads[b]);
+        grads[b].seq = b;
+        Stats::add(Stats::SAMPLES, samples.size());
+        Stats::add(Stats::NNZ, nnz);
+      }
+      barrier.wait(); // gradients are computed
+      {
+        TraceSpan span("apply");
+        for (size_t k = id; k < GradBuffer::N_BUCKETS; k += n_threads)
+          for (size_t b = 0; b < n_batches; b++)
+            model->apply_grad(grads[b], k);
+      }
+      barrier.wait(); // gradients are applied
+    }
+  };
+
+  vector<thread> train_threads;
+  for (size_t i = 0; i < n_threads; ++i)
+  {
+    train_threads.emplace_back(work, i);
+    stringstream ss;
+    ss << "train_" << std::setfill('0') << std::setw(2) << i;
+    pthread_setname_np(train_threads[i].native_handle(), ss.str().c_str());
+    Numa::pin_thread(train_threads[i].native_handle(), i + 1);
+  }
+
+  Clock                   last = Time::now();
+  chrono::duration<float> cost{};
+  read_round(next_round);
+  while (true)
+  {
+    round.swap(next_round);
+    barrier.wait();
+    if (round.empty())
+      break;
+    read_round(next_round);
+    barrier.wait();
+    barrier.wait();
+    model->add_steps((round.size() + cfg.batch_size - 1) / cfg.batch_size);
+    n_sample += round.size();
+    if (verbose && n_sample / step != (n_sample - round.size()) / step) [[unlikely]]
+    {
+      cost = Time::now() - last;
+      spdlog::info("epoch {:4d}: {:8d} samples, {:.4f} secs", epoch_i, n_sample, cost.count());
+      last = Time::now();
+    }
+  }
+  for (auto& th : train_threads)
+    th.join();
+  return n_sample;
+}
+
+// Trains models on lines of next_line until it returns nullptr, by the reader (calling thread) and
+// train_thread_num train threads, lines are read and parsed once for all models. Parsed samples are
+// kept in cache if given. Returns num of samples.
+template <typename NextLine>
+size_t train_pass(const vector<Base*>& models, NextLine next_line, size_t epoch_i, bool verbose,
+                  SampleCache* cache = nullptr)
+{
+  if (cfg.deterministic)
+    return train_pass_deterministic(models[0], next_line, epoch_i, verbose);
+  size_t         n_sample = 0, step = 1000000;
+  atomic<size_t> n_dropped{0};
+
+  BlockingQueue<unique_ptr<vector<unique_ptr<string>>>> line_queue(get_queue_depth());
+
+  vector<thread> train_threads;
+  for (Base* model : models)
+    model->start_threads(cfg.train_thread_num);
+  for (size_t i = 0; i < cfg.train_thread_num; ++i)
+  {
+    train_threads.emplace_back(train_thread, i, cref(models), ref(line_queue), cache, epoch_i,
+                               ref(n_dropped));
+    stringstream ss;
+    ss << "train_" << std::setfill('0') << std::setw(2) << i;
+    pthread_setname_np(train_threads[i].native_handle(), ss.str().c_str());
+    Numa::pin_thread(train_threads[i].native_handle(), i + 1);
+  }
+
+  Clock                   last = Time::now();
+  chrono::duration<float> cost{};
+  size_t                  package_size = get_package_size(cfg.batch_size);
+  size_t                  line_no      = 0;
+  while (true)
+  {
+    unique_ptr<vector<unique_ptr<string>>> lines = make_unique<vector<unique_ptr<string>>>();
+    lines->reserve(package_size);
+    {
+      TraceSpan span("split");
+      while (lines->size() < package_size)
+      {
+        unique_ptr<string> line = next_line();
+        if (line == nullptr)
+          break;
+        uint64_t no = line_no++;
+        if ((cfg.num_workers > 1 && no % cfg.num_workers != cfg.worker_id)
+            || (cache == nullptr && drop_negative(*line, no, epoch_i)))
+          continue;
+        lines->push_back(std::move(line));
+      }
+    }
+    size_t n_lines = lines->size();
+    if (n_lines == 0)
+      break;
+    Stats::add(Stats::LINES, n_lines);
+    line_queue.push(std::move(lines));
+    n_sample += n_lines;
+    if (cfg.max_model_mem > 0 && n_sample / package_size % 8 == 0)
+      for (Base* model : models)
+        enforce_mem_budget(model);
+    if (verbose && n_sample / step != (n_sample - n_lines) / step) [[unlikely]]
+    {
+      cost = Time::now() - last;
+      spdlog::info("epoch {:4d}: {:8d} samples, {:.4f} secs", epoch_i, n_sample, cost.count());
+      last = Time::now();
+    }
+    if (n_lines < package_size)
+      break;
+  }
+  for (size_t i = 0; i != cfg.train_thread_num; ++i)
+    line_queue.push(nullptr);
+  for (auto& th : train_threads)
+    if (th.joinable())
+      th.join();
+  return n_sample - n_dropped;
+}
+
+// Trains models on chunks of chunk_queue, the rows of each chunk shuffled by seed and chunk if
+// shuffle, so chunks are shuffled in parallel.
+void train_cached_thread(const int id, const vector<Base*>& models, const SampleCache& cache,
+                         uint64_t seed, size_t epoch_i, BlockingQueue<long>& chunk_queue,
+                         atomic<size_t>& n_dropped)
+{
+  stringstream ss;
+  ss << "train_" << std::setfill('0') << std::setw(2) << id;
+  Stats::set_thread_name(ss.str());
+  Trace::set_thread_name(ss.str());
+  Numa::interleave_thread();
+  for (Base* model : models)
+    model->thread_begin(id);
+
+  vector<unique_ptr<Sample>> samples; // reused with their buffers of features
+  vector<uint32_t>           rows;
+  while (true)
+  {
+    long c;
+    chunk_queue.pop(c);
+    if (c < 0) [[unlikely]]
+    {
+      break;
+    }
+    const SampleChunk& chunk = cache.chunk(c);
+    rows.clear();
+    for (uint32_t r = 0; r < chunk.rows(); r++)
+      if (!drop_negative(chunk.y[r] == 0, chunk.key(r), epoch_i))
+        rows.push_back(r);
+    n_dropped += chunk.rows() - rows.size();
+    if (cfg.shuffle)
+    {
+      mt19937_64 rng(mix64(seed ^ c));
+      shuffle(rows.begin(), rows.end(), rng);
+    }
+    for (size_t begin = 0; begin < rows.size(); begin += cfg.batch_size)
+    {
+      size_t n   = min<size_t>(cfg.batch_size, rows.size() - begin);
+      size_t nnz = 0;
+      while (samples.size() < n)
+        samples.push_back(make_unique<Sample>(0, make_unique<SampleX>()));
+      samples.resize(n);
+      {
+        StatTimer timer(Stats::PARSE_NS);
+        TraceSpan span("parse");
+        for (size_t i = 0; i < n; i++)
+        {
+          chunk.get(rows[begin + i], *samples[i]);
+          nnz += samples[i]->x->size();
+        }
+      }
+      {
+        StatTimer timer(Stats::LEARN_NS);
+        TraceSpan span("learn");
+        for (Base* model : models)
+          model->learn(samples);
+      }
+      Stats::add(Stats::SAMPLES, n);
+      Stats::add(Stats::NNZ, nnz);
+    }
+  }
+  for (Base* model : models)
+    model->thread_end();
+}
+
+// Trains models on samples of cache, by train_thread_num train threads fed chunks by the calling
+// thread, in shuffled order if shuffle. Returns num of samples.
+size_t train_pass_cached(const vector<Base*>& models, const SampleCache& cache, size_t epoch_i,
+                         bool verbose)
+{
+  size_t              n_sample = 0, step = 1000000;
+  uint64_t            seed     = mix64((uint64_t)cfg.seed ^ (uint64_t)epoch_i << 32);
+  BlockingQueue<long> chunk_queue(get_queue_depth());
+  atomic<size_t>      n_dropped{0};
+
+  vector<thread> train_threads;
+  for (Base* model : models)
+    model->start_threads(cfg.train_thread_num);
+  for (size_t i = 0; i < cfg.train_thread_num; ++i)
+  {
+    train_threads.emplace_back(train_cached_thread, i, cref(models), cref(cache), seed, epoch_i,
+                               ref(chunk_queue), ref(n_dropped));
+    stringstream ss;
+    ss << "train_" << std::setfill('0') << std::setw(2) << i;
+    pthread_setname_np(train_threads[i].native_handle(), ss.str().c_str());
+    Numa::pin_thread(train_threads[i].native_handle(), i + 1);
+  }
+
+  Clock                   last = Time::now();
+  chrono::duration<float> cost{};
+  size_t                  n_chunks = 0;
+  for (size_t c : cache.order(cfg.shuffle, seed))
+  {
+    size_t n_rows = cache.chunk(c).rows();
+    chunk_queue.push((long)c);
+    n_sample += n_rows;
+    if (cfg.max_model_mem > 0 && ++n_chunks % 8 == 0)
+      for (Base* model : models)
+        enforce_mem_budget(model);
+    if (verbose && n_sample / step != (n_sample - n_rows) / step) [[unlikely]]
+    {
+      cost = Time::now() - last;
+      spdlog::info("epoch {:4d}: {:8d} samples, {:.4f} secs", epoch_i, n_sample, cost.count());
+      last = Time::now();
+    }
+  }
+  for (size_t i = 0; i != cfg.train_thread_num; ++i)
+    chunk_queue.push(-1);
+  for (auto& th : train_threads)
+    th.join();
+  return n_sample - n_dropped;
+}
+
+/*********************************************************
+*  autotune                                              *
+*********************************************************/
+struct Probe
+{
+  uint32_t train_thread_num;
+  uint32_t batch_size;
+  uint32_t package_size;
+  uint32_t queue_depth;
+  double   samples_per_sec = 0;
+  double   auc             = 0;
+
+  [[nodiscard]] string args() const
+  {
+    return fmt::format("--tt {} --batch_size {} --package_size {} --queue_depth {}",
+                       train_thread_num, batch_size, package_size, queue_depth);
+  }
+};
+
+// trains a new model on lines with the config of probe, and measures throughput and AUC on holdout
+void run_probe(Probe& probe, const vector<string>& lines, const vector<unique_ptr<Sample>>& holdout)
+{
+  cfg.train_thread_num = probe.train_thread_num;
+  cfg.batch_size       = probe.batch_size;
+  cfg.package_size     = probe.package_size;
+  cfg.queue_depth      = probe.queue_depth;
+
+  unique_ptr<Base> model(make_model());
+  model->set_max_mem((size_t)(cfg.max_model_mem * MB));
+  size_t next  = 0;
+  Clock  begin = Time::now();
+  size_t n     = train_pass(
+    {model.get()},
+    [&]() -> unique_ptr<string> {
+      return next < lines.size() ? make_unique<string>(lines[next++]) : nullptr;
+    },
+    0, false);
+  chrono::duration<double> cost = Time::now() - begin;
+
+  vector<F>   y_pred;
+  vector<int> y_true;
+  model->predict_batch(holdout, y_pred);
+  for (auto& sample : holdout)
+    y_true.push_back((int)sample->y);
+  probe.samples_per_sec = (double)n / cost.count();
+  probe.auc             = holdout.empty() ? 0 : calc_auc(y_pred, y_true);
+  spdlog::info("autotune: {}: {:.0f} samples/s, AUC: {:.6f}", probe.args(), probe.samples_per_sec,
+               probe.auc);
+}
+
+// Searches train threads, batch size, package size and queue depth one at a time, starting from
+// the given config, on the first autotune_rows lines of training file, the last 20% of them held
+// out for AUC. The fastest config within autotune_auc_tol of the AUC of the given one is applied
+// to cfg. There is a single reader thread, so the num of readers is not searched.
+void autotune()
+{
+  TraceSpan span("autotune");
+  spdlog::info("**************** autotune ****************");
+  vector<string>             lines;
+  vector<unique_ptr<Sample>> holdout;
+  {
+    Parser parser(cfg.train_file);
+    while (lines.size() < cfg.autotune_rows)
+    {
+      unique_ptr<string> line = parser.nextLine();
+      if (line == nullptr)
+        break;
+      lines.push_back(std::move(*line));
+    }
+  }
+  size_t n_train = lines.size() - lines.size() / 5;
+  for (size_t i = n_train; i < lines.size(); i++)
+    if (unique_ptr<Sample> sample = Sample::parse(lines[i], vocab.get()))
+      holdout.push_back(std::move(sample));
+  lines.resize(n_train);
+  spdlog::info("autotune on {} lines, {} held out", lines.size(), holdout.size());
+
+  Config saved = cfg;
+  Probe  best{cfg.train_thread_num, cfg.batch_size, (uint32_t)get_package_size(cfg.batch_size),
+             (uint32_t)get_queue_depth()};
+  run_probe(best, lines, holdout);
+  double base_auc = best.auc;
+
+  auto search = [&](const vector<uint32_t>& values, auto set) {
+    Probe start = best;
+    for (uint32_t v : values)
+    {
+      Probe probe = start;
+      set(probe, v);
+      if (probe.args() == start.args())
+        continue;
+      run_probe(probe, lines, holdout);
+      bool auc_ok = cfg.autotune_auc_tol < 0 || probe.auc >= base_auc - cfg.autotune_auc_tol;
+      if (auc_ok && probe.samples_per_sec > best.samples_per_sec)
+        best = probe;
+    }
+  };
+
+  // a seeded run is reproducible with more than 1 train thread only in deterministic mode
+  vector<uint32_t> threads;
+  uint32_t         n_cpus   = max(1u, thread::hardware_concurrency());
+  bool             parallel = saved.seed == -1 || saved.deterministic;
+  if (parallel)
+    for (uint32_t n = 1; n < n_cpus; n *= 2)
+      threads.push_back(n);
+  threads.push_back(parallel ? n_cpus : 1);
+  search(threads, [](Probe& p, uint32_t v) {
+    p.train_thread_num = v;
+    p.queue_depth      = v * 2;
+  });
+  search({16, 32, 64, 128, 256, 512}, [](Probe& p, uint32_t v) {
+    p.batch_size   = v;
+    p.package_size = max(v, 2048u);
+  });
+  search({512, 1024, 2048, 4096, 8192, 16384, 32768}, [](Probe& p, uint32_t v) {
+    p.package_size = max(v, p.batch_size);
+  });
+  search({1, 2, 4, 8}, [](Probe& p, uint32_t v) { p.queue_depth = p.train_thread_num * v; });
+
+  cfg                  = saved;
+  cfg.train_thread_num = best.train_thread_num;
+  cfg.batch_size       = best.batch_size;
+  cfg.package_size     = best.package_size;
+  cfg.queue_depth      = best.queue_depth;
+  spdlog::info("autotune: chose {}, {:.0f} samples/s, AUC: {:.6f}", best.args(),
+               best.samples_per_sec, best.auc);
+  if (!cfg.autotune_save.empty())
+  {
+    ofstream ofs(cfg.autotune_save);
+    ofs << best.args() << endl;
+    spdlog::info("autotune: args saved to {}", cfg.autotune_save);
+  }
+}
+
 int run()
 {
   if (cfg.seed != -1)
@@ -113,17 +929,73 @@ int run()
   Clock                   t_begin, t_end;
   chrono::duration<float> cost{};
 
-  Base* model;
-  if (cfg.model == "lr")
-    model = new LR(cfg.w_lr, cfg.w_l2);
-  if (cfg.model == "fm")
-    model = new FM(cfg.k, cfg.w_lr, cfg.v_lr, cfg.w_l2, cfg.v_l2, cfg.v_stddev, cfg.seed);
+  if (!cfg.trace_file.empty())
+    Trace::start();
+  Stats::set_thread_name("reader");
+  Trace::set_thread_name("reader");
+  if (cfg.numa)
+  {
+    Numa::init();
+    Numa::pin_thread(pthread_self(), 0);
+    Numa::interleave_thread(); // for the initial weight tables
+  }
+  unique_ptr<StatsReporter> stats_reporter;
+  if (cfg.stats_interval > 0)
+  {
+    Stats::enabled = true;
+    stats_reporter = make_unique<StatsReporter>(cfg.stats_interval, cfg.stats_file);
+    stats_reporter->start();
+  }
+  Parser::direct_io = cfg.direct_io;
+
+  if (cfg.build_vocab)
+  {
+    build_vocab();
+  }
+  else if (!cfg.vocab.empty())
+  {
+    vocab = make_unique<Vocab>();
+    if (!vocab->load(cfg.vocab))
+      exit(-1);
+    spdlog::info("vocab: {} ids loaded from {}", vocab->rows() - 1, cfg.vocab);
+  }
+
+  // dense rows are sized before loading, by k of the loaded model rather than --factor
+  if (vocab != nullptr && !cfg.load.empty() && cfg.model == "fm")
+  {
+    uint32_t k = model_k(cfg.load);
+    if (k > 0 && k != cfg.k)
+    {
+      spdlog::info("factor {} of {} overrides {}", k, cfg.load, cfg.k);
+      cfg.k = k;
+    }
+  }
+
+  if (cfg.autotune)
+    autotune();
+
+  vector<Config> configs = sweep.empty() ? vector<Config>{cfg} : sweep;
+  vector<Base*>  models;
+  for (const Config& c : configs)
+  {
+    if (!sweep.empty())
+      spdlog::info("model {}: {}, k {}, w_lr {}, v_lr {}, w_l2 {}, v_l2 {}, v_stddev {}, save {}",
+                   models.size(), c.model, c.k, c.w_lr, c.v_lr, c.w_l2, c.v_l2, c.v_stddev,
+                   c.save);
+    if (cfg.role == "worker")
+      models.push_back(new PSModel(cfg.ps_servers, [] { return unique_ptr<Base>(make_model()); }));
+    else
+      models.push_back(make_model(c));
+    models.back()->set_max_mem((size_t)(cfg.max_model_mem * MB));
+  }
+  Base* model = models[0]; // the only one but with --sweep
 
   /*********************************************************
   *  model loading                                         *
   *********************************************************/
   if (!cfg.load.empty())
   {
+    TraceSpan span("load");
     t_begin = Time::now();
     spdlog::info("**************** load model ****************");
     spdlog::info("load from {}", cfg.load);
@@ -136,132 +1008,244 @@ int run()
     t_end = Time::now();
     cost  = t_end - t_begin;
     spdlog::info("finish, num_feat: {}, costs {:.4f} secs", model_size, cost.count());
+    log_mem(model);
+  }
+
+  // a loaded model keeps the rate it was trained with, unless it is trained further
+  if (!cfg.train_file.empty())
+    for (Base* m : models)
+      m->set_neg_sample_rate(cfg.neg_sample_rate);
+
+  if (cfg.hot_rows > 0)
+  {
+    vector<uint32_t> hot_ids = find_hot_ids();
+    for (Base* m : models)
+    {
+      m->set_hot_rows(hot_ids);
+      log_mem(m);
+    }
   }
 
   /*********************************************************
   *  training                                              *
   *********************************************************/
+  bool saved = false; // by early stopping, which keeps the best model at cfg.save
   if (!cfg.train_file.empty())
   {
-    Parser parser_train(cfg.train_file);
+    auto parser_train = make_unique<Parser>(cfg.train_file);
+    auto cache        = cfg.cache_in_memory ? make_unique<SampleCache>() : nullptr;
+
+    double best_auc   = -1;
+    size_t best_epoch = 0, last_epoch = 0;
     for (size_t epoch_i = 0; epoch_i < cfg.epoch; epoch_i++)
     {
+      last_epoch = epoch_i;
       t_begin = Time::now();
       spdlog::info("******************************************************");
-      int n_sample = 0, step = 1000000;
-
-      BlockingQueue<unique_ptr<vector<unique_ptr<string>>>> line_queue(cfg.train_thread_num * 2);
-
-      vector<thread> train_threads;
-      for (size_t i = 0; i < cfg.train_thread_num; ++i)
-      {
-        train_threads.emplace_back(train_thread, i, model, ref(line_queue));
-        stringstream ss;
-        ss << "train_" << std::setfill('0') << std::setw(2) << i;
-        pthread_setname_np(train_threads[i].native_handle(), ss.str().c_str());
-      }
-
-      Clock last = Time::now();
-      parser_train.reset();
-      unique_ptr<vector<unique_ptr<string>>> lines = make_unique<vector<unique_ptr<string>>>();
-      size_t                                 package_size = get_package_size(cfg.batch_size);
-      lines->reserve(package_size);
-      while (unique_ptr<string> line = parser_train.nextLine())
+      size_t n_sample;
+      if (cache != nullptr && cache->ready())
       {
-        lines->push_back(std::move(line));
-        if (lines->size() == package_size)
-        {
-          line_queue.push(std::move(lines));
-          lines = make_unique<vector<unique_ptr<string>>>();
-          lines->reserve(package_size);
-        }
-        n_sample++;
-        if (n_sample % step == 0) [[unlikely]]
-        {
-          cost = Time::now() - last;
-          spdlog::info("epoch {:4d}: {:8d} samples, {:.4f} secs", epoch_i, n_sample, cost.count());
-          last = Time::now();
-        }
+        n_sample = train_pass_cached(models, *cache, epoch_i, true);
       }
-      if (!lines->empty())
+      else
       {
-        line_queue.push(std::move(lines));
-        lines = nullptr;
+        parser_train->reset();
+        n_sample = train_pass(
+          models, [&parser_train] { return parser_train->nextLine(); }, epoch_i, true, cache.get());
       }
-      for (size_t i = 0; i != cfg.train_thread_num; ++i)
-        line_queue.push(nullptr);
-      for (auto& th : train_threads)
-        if (th.joinable())
-          th.join();
-
       t_end = Time::now();
       cost  = t_end - t_begin;
       spdlog::info("epoch {:4d}, trained on {} samples, costs {:.4f} secs", epoch_i, n_sample,
                    cost.count());
+      if (cache != nullptr && !cache->ready())
+      {
+        cache->finish();
+        parser_train.reset(); // frees its buffer, the file is not read again
+        spdlog::info("cache: {} samples in {} chunks, {:.1f}MB", cache->rows(), cache->size(),
+                     cache->bytes() / MB);
+      }
+      for (Base* m : models)
+      {
+        if (cfg.max_model_mem > 0)
+          enforce_mem_budget(m);
+        log_mem(m);
+      }
 
       /*********************************************************
       *  validation                                            *
       *********************************************************/
-      if (!cfg.valid_file.empty())
+      if (cfg.valid_file.empty())
+        continue;
+      // the last epoch is validated in full, unless early stopping may reload an earlier one
+      bool   last = epoch_i + 1 == cfg.epoch && cfg.early_stop == 0;
+      double auc  = validate(models, last ? 1 : cfg.valid_sample)[0];
+      if (cfg.early_stop == 0)
+        continue;
+      if (auc > best_auc)
       {
-        t_begin = Time::now();
-        Parser      parser_valid(cfg.valid_file);
-        vector<F>   y_pred;
-        vector<int> y_true;
-        while (unique_ptr<string> line = parser_valid.nextLine())
-        {
-          unique_ptr<Sample> sample = make_unique<Sample>(*line);
-          F                  pred   = model->predict_prob(sample);
-          y_pred.emplace_back(pred);
-          y_true.emplace_back(sample->y);
-          if (cfg.debug)
-            spdlog::debug("PRED {:.4f} {}", pred, sample->y);
-        }
-        t_end = Time::now();
-        cost  = t_end - t_begin;
-        spdlog::info("{}, {} samples, AUC: {:.6f}, costs {:.4f} secs", cfg.valid_file,
-                     y_pred.size(), calc_auc(y_pred, y_true), cost.count());
+        best_auc   = auc;
+        best_epoch = epoch_i;
+        save_model(model, cfg.save);
+        saved = true;
+      }
+      else if (epoch_i - best_epoch >= cfg.early_stop)
+      {
+        spdlog::info("early stop, no better AUC in {} epochs since epoch {}", cfg.early_stop,
+                     best_epoch);
+        break;
       }
     }
+
+    if (saved && best_epoch != last_epoch)
+    {
+      TraceSpan span("load");
+      spdlog::info("reload model of epoch {} from {}", best_epoch, cfg.save);
+      model->clear();
+      if (model->load(cfg.save) == 0)
+      {
+        spdlog::error("error loading model {}", cfg.save);
+        exit(-1);
+      }
+    }
+    if (cfg.early_stop > 0 && cfg.valid_sample < 1 && !cfg.valid_file.empty())
+      validate(models, 1);
   }
 
   /*********************************************************
   *  model saving                                          *
   *********************************************************/
-  if (!cfg.save.empty())
-  {
-    t_begin = Time::now();
-    spdlog::info("**************** save model ****************");
-    spdlog::info("save to {}", cfg.save);
-    model->save(cfg.save);
-    t_end = Time::now();
-    cost  = t_end - t_begin;
-    spdlog::info("finish, costs {:.4f} secs", cost.count());
-  }
+  if (!saved)
+    for (size_t m = 0; m < models.size(); m++)
+      if (!configs[m].save.empty())
+        save_model(models[m], configs[m].save);
 
   /*********************************************************
   *  predict                                               *
   *********************************************************/
   if (!(cfg.test_file.empty() || cfg.test_pred_file.empty()))
   {
+    TraceSpan span("predict");
     t_begin = Time::now();
     spdlog::info("**************** predict ****************");
     spdlog::info("input: {}", cfg.test_file);
-    spdlog::info("output: {}", cfg.test_pred_file);
-    Parser   parser_test(cfg.test_file);
-    ofstream ofs;
-    ofs.open(cfg.test_pred_file, ofstream::out);
-    while (unique_ptr<string> line = parser_test.nextLine())
+    vector<ofstream> ofs(models.size());
+    for (size_t m = 0; m < models.size(); m++)
     {
-      unique_ptr<Sample> sample = make_unique<Sample>(*line);
-      F                  pred   = model->predict_prob(sample);
-      ofs << pred << endl;
+      spdlog::info("output: {}", configs[m].test_pred_file);
+      ofs[m].open(configs[m].test_pred_file, ofstream::out);
     }
-    ofs.close();
+    predict_file(models, cfg.test_file, true, 1,
+                 [&](size_t m, F pred, const unique_ptr<Sample>&) { ofs[m] << pred << endl; });
+    for (auto& f : ofs)
+      f.close();
     t_end = Time::now();
     cost  = t_end - t_begin;
     spdlog::info("finish, costs {:.4f} secs", cost.count());
   }
+
+  if (cfg.role == "worker")
+    ((PSModel*)model)->finish();
+  if (stats_reporter != nullptr)
+    stats_reporter->stop();
+  if (!cfg.trace_file.empty())
+    Trace::save(cfg.trace_file);
+  return 0;
+}
+
+// serves shard ps_id of the model to workers until all of them are done
+int run_ps()
+{
+  Base* model = make_model();
+  model->set_max_mem((size_t)(cfg.max_model_mem * MB));
+  if (!cfg.load.empty())
+  {
+    spdlog::info("load from {}", cfg.load);
+    size_t model_size = model->load(cfg.load);
+    if (model_size == 0)
+    {
+      spdlog::error("error loading model {}", cfg.load);
+      exit(-1);
+    }
+    spdlog::info("finish, num_feat: {}", model_size);
+  }
+  PSServer server(model, cfg.ps_servers[cfg.ps_id], cfg.num_workers, [model] {
+    if (cfg.max_model_mem > 0)
+      enforce_mem_budget(model);
+  });
+  int ret = server.serve();
+  log_mem(model);
+  return ret;
+}
+
+// Reads configs of --sweep, one per line of whitespace separated key=value, keys model, w_lr, v_lr,
+// w_l2, v_l2, v_stddev, k, save and test_pred override cfg. Model i, from 0, is saved to <save>.i
+// and predicts to <test_pred>.i by default. Empty lines and lines starting with # are skipped.
+int load_sweep()
+{
+  ifstream ifs(cfg.sweep);
+  string   line;
+  if (!ifs)
+  {
+    cerr << "can not open sweep file " << cfg.sweep << "\n";
+    return -1;
+  }
+  for (size_t line_no = 0; getline(ifs, line); line_no++)
+  {
+    if (line.find_first_not_of(" \t\r") == string::npos || line[0] == '#')
+      continue;
+    Config c = cfg;
+    c.save += cfg.save.empty() ? "" : "." + to_string(sweep.size());
+    c.test_pred_file += "." + to_string(sweep.size());
+    istringstream iss(line);
+    string        kv;
+    while (iss >> kv)
+    {
+      size_t eq    = kv.find('=');
+      string key   = kv.substr(0, eq);
+      string value = eq == string::npos ? "" : kv.substr(eq + 1);
+      bool   ok    = !value.empty();
+      if (key == "model")
+        c.model = value;
+      else if (key == "save")
+        c.save = value;
+      else if (key == "test_pred")
+        c.test_pred_file = value;
+      else
+      {
+        char*  end;
+        double num = strtod(value.c_str(), &end);
+        ok         = ok && *end == '\0';
+        if (key == "w_lr")
+          c.w_lr = (F)num;
+        else if (key == "v_lr")
+          c.v_lr = (F)num;
+        else if (key == "w_l2")
+          c.w_l2 = (F)num;
+        else if (key == "v_l2")
+          c.v_l2 = (F)num;
+        else if (key == "v_stddev")
+          c.v_stddev = (F)num;
+        else if (key == "k")
+        {
+          ok  = ok && num >= 1 && num <= UINT32_MAX && num == (uint32_t)num;
+          c.k = ok ? (uint32_t)num : 0;
+        }
+        else
+          ok = false;
+      }
+      if (!ok)
+      {
+        cerr << "sweep parse error, line " << line_no + 1 << ": [" << kv << "]\n";
+        return -1;
+      }
+    }
+    sweep.push_back(c);
+  }
+  if (sweep.empty())
+  {
+    cerr << "no configs in sweep file " << cfg.sweep << "\n";
+    return -1;
+  }
   return 0;
 }
 
@@ -272,9 +1256,120 @@ int check_args()
     cerr << "model must be lr or fm\n";
     return -1;
   }
-  if (cfg.seed != -1 && !(cfg.train_thread_num == 1))
+  if (cfg.mem_policy != "evict" && cfg.mem_policy != "refuse")
+  {
+    cerr << "mem_policy must be evict or refuse\n";
+    return -1;
+  }
+  if (cfg.role != "local" && cfg.role != "ps" && cfg.role != "worker")
+  {
+    cerr << "role must be local, ps or worker\n";
+    return -1;
+  }
+  if (cfg.role != "local" && cfg.ps_servers.empty())
+  {
+    cerr << "ps and worker roles need addresses of parameter servers by --ps\n";
+    return -1;
+  }
+  if (cfg.role == "ps" && cfg.ps_id >= cfg.ps_servers.size())
+  {
+    cerr << "ps_id must be less than num of parameter servers\n";
+    return -1;
+  }
+  if (cfg.role == "worker" && (cfg.worker_id >= cfg.num_workers || !cfg.load.empty()))
+  {
+    cerr << "worker_id must be less than num_workers, and models are loaded by -i of ps\n";
+    return -1;
+  }
+  if (cfg.early_stop > 0
+      && (cfg.role != "local" || cfg.valid_file.empty() || cfg.save.empty()))
+  {
+    cerr << "early_stop needs a validation file and --save for checkpoints, and runs only with "
+            "local role\n";
+    return -1;
+  }
+  if (cfg.hot_rows > 0 && (cfg.role != "local" || cfg.sharded || cfg.train_file.empty()))
+  {
+    cerr << "hot_rows needs a training file, and runs only with local role and without sharded\n";
+    return -1;
+  }
+  if ((cfg.build_vocab || !cfg.vocab.empty())
+      && (cfg.role != "local" || cfg.sharded || cfg.hot_rows > 0))
+  {
+    cerr << "vocab runs only with local role, and without sharded or hot_rows\n";
+    return -1;
+  }
+  if (cfg.build_vocab && (cfg.train_file.empty() || !cfg.vocab.empty()))
+  {
+    cerr << "build_vocab needs a training file, and excludes --vocab\n";
+    return -1;
+  }
+  if (!(cfg.valid_sample > 0 && cfg.valid_sample <= 1))
+  {
+    cerr << "valid_sample must be in (0, 1]\n";
+    return -1;
+  }
+  if (cfg.w_lr * cfg.w_l2 >= 1 || cfg.v_lr * cfg.v_l2 >= 1)
   {
-    cerr << "random seed should be used with 1 train_thread\n";
+    cerr << "lr * l2 must be less than 1, or l2 decay flips sign of weights\n";
+    return -1;
+  }
+  for (const Config& c : sweep)
+  {
+    if ((c.model != "lr" && c.model != "fm") || c.w_lr * c.w_l2 >= 1 || c.v_lr * c.v_l2 >= 1)
+    {
+      cerr << "model of sweep must be lr or fm, and lr * l2 less than 1\n";
+      return -1;
+    }
+  }
+  if (cfg.cache_in_memory && cfg.deterministic)
+  {
+    cerr << "cache_in_memory does not support deterministic mode\n";
+    return -1;
+  }
+  if (cfg.shuffle && !cfg.cache_in_memory)
+  {
+    cerr << "shuffle needs cache_in_memory\n";
+    return -1;
+  }
+  if (!(cfg.neg_sample_rate > 0 && cfg.neg_sample_rate <= 1))
+  {
+    cerr << "neg_sample_rate must be in (0, 1]\n";
+    return -1;
+  }
+  if (cfg.neg_sample_rate < 1 && cfg.role != "local")
+  {
+    cerr << "neg_sample_rate runs only with local role\n";
+    return -1;
+  }
+  if (!cfg.sweep.empty()
+      && (cfg.role != "local" || cfg.sharded || cfg.deterministic || cfg.autotune
+          || cfg.early_stop > 0 || !cfg.load.empty()))
+  {
+    cerr << "sweep runs only with local role, and without sharded, deterministic, autotune, "
+            "early_stop or --load\n";
+    return -1;
+  }
+  if (cfg.sharded && (cfg.role != "local" || (cfg.max_model_mem > 0 && cfg.mem_policy != "refuse")))
+  {
+    cerr << "sharded model is trained locally, and supports only refuse policy of memory budget\n";
+    return -1;
+  }
+  if (cfg.autotune && (cfg.role != "local" || cfg.train_file.empty()))
+  {
+    cerr << "autotune needs a training file, and runs only with local role\n";
+    return -1;
+  }
+  if (cfg.deterministic
+      && (cfg.sharded || cfg.role != "local" || cfg.max_model_mem > 0 || cfg.round_batches == 0))
+  {
+    cerr << "deterministic mode needs round_batches > 0, and does not support sharded model, "
+            "parameter servers or memory budget\n";
+    return -1;
+  }
+  if (cfg.seed != -1 && !(cfg.train_thread_num == 1 || cfg.deterministic))
+  {
+    cerr << "random seed should be used with 1 train_thread, or deterministic mode\n";
     return -1;
   }
   return 0;
@@ -324,6 +1419,116 @@ int main(int argc, char* argv[])
                      cxxopts::value<long>()->default_value("-1"), "");
   options.add_option(group, "d", "debug", "debug", cxxopts::value<bool>()->default_value("false"),
                      "");
+  options.add_option(group, "", "stats_interval",
+                     "secs between throughput/stall reports of hot-path counters, 0: disabled",
+                     cxxopts::value<double>()->default_value("0"), "");
+  options.add_option(group, "", "stats_file",
+                     "file to dump counters at each report, json if ends with .json, "
+                     "otherwise prometheus text format",
+                     cxxopts::value<std::string>()->default_value(""), "");
+  options.add_option(group, "", "trace", "file to save timeline of pipeline stages in chrome "
+                     "trace-event format, for perfetto or chrome://tracing",
+                     cxxopts::value<std::string>()->default_value(""), "");
+  options.add_option(group, "", "max_model_mem", "memory budget of model store in MB, 0: unlimited",
+                     cxxopts::value<double>()->default_value("0"), "");
+  options.add_option(group, "", "mem_policy",
+                     "when memory budget is reached, evict: evict rows of smallest magnitude and "
+                     "refuse new rows until evicted, refuse: refuse new rows",
+                     cxxopts::value<std::string>()->default_value("evict"), "");
+  options.add_option(group, "", "role",
+                     "local: train in this process, ps: serve a shard of model, worker: train "
+                     "with parameter servers",
+                     cxxopts::value<std::string>()->default_value("local"), "");
+  options.add_option(group, "", "ps",
+                     "comma separated addresses of parameter servers, host:port or unix:path",
+                     cxxopts::value<std::string>()->default_value(""), "");
+  options.add_option(group, "", "ps_id", "index in --ps of this parameter server",
+                     cxxopts::value<uint32_t>()->default_value("0"), "");
+  options.add_option(group, "", "worker_id",
+                     "index of this worker, it trains on lines where line_no % num_workers == "
+                     "worker_id, worker 0 also validates, saves and predicts",
+                     cxxopts::value<uint32_t>()->default_value("0"), "");
+  options.add_option(group, "", "num_workers", "num of workers",
+                     cxxopts::value<uint32_t>()->default_value("1"), "");
+  options.add_option(group, "", "numa",
+                     "pin reader and train threads round-robin over numa nodes, allocate parser "
+                     "buffers on the reader's node, interleave weight tables over nodes",
+                     cxxopts::value<bool>()->default_value("false"), "");
+  options.add_option(group, "", "sharded",
+                     "partition features over train threads, each thread updates only its own "
+                     "partition and routes other gradients to their owners",
+                     cxxopts::value<bool>()->default_value("false"), "");
+  options.add_option(group, "", "package_size",
+                     "num of lines the reader hands to a train thread at a time, 0: batch_size "
+                     "doubled up to 2048",
+                     cxxopts::value<uint32_t>()->default_value("0"), "");
+  options.add_option(group, "", "queue_depth",
+                     "num of packages queued between reader and train threads, 0: 2 * tt",
+                     cxxopts::value<uint32_t>()->default_value("0"), "");
+  options.add_option(group, "", "autotune",
+                     "before training, search tt, batch_size, package_size and queue_depth for the "
+                     "best throughput by short runs on a prefix of training file",
+                     cxxopts::value<bool>()->default_value("false"), "");
+  options.add_option(group, "", "autotune_rows", "num of lines of training file used by autotune",
+                     cxxopts::value<uint32_t>()->default_value("200000"), "");
+  options.add_option(group, "", "autotune_auc_tol",
+                     "autotune rejects configs losing more AUC than this on held out lines, "
+                     "negative: no check",
+                     cxxopts::value<double>()->default_value("0.002"), "");
+  options.add_option(group, "", "autotune_save", "file to save args chosen by autotune",
+                     cxxopts::value<std::string>()->default_value(""), "");
+  options.add_option(group, "", "deterministic",
+                     "train in rounds whose batch gradients are computed in parallel and applied "
+                     "in batch order, models are identical for any tt given --seed",
+                     cxxopts::value<bool>()->default_value("false"), "");
+  options.add_option(group, "", "round_batches", "num of batches per round of deterministic mode",
+                     cxxopts::value<uint32_t>()->default_value("16"), "");
+  options.add_option(group, "", "early_stop",
+                     "stop after this num of epochs without better validation AUC, the best model "
+                     "is checkpointed to --save and reloaded for testing, 0: disabled",
+                     cxxopts::value<uint32_t>()->default_value("0"), "");
+  options.add_option(group, "", "valid_sample",
+                     "validate epochs on this fraction of lines of validation file, a fixed hashed "
+                     "subsample, the final model is validated in full",
+                     cxxopts::value<double>()->default_value("1"), "");
+  options.add_option(group, "", "hot_rows",
+                     "num of most frequent feature ids kept in a dense array apart from the hash "
+                     "table, found by counting on a prefix of training file, 0: disabled",
+                     cxxopts::value<uint32_t>()->default_value("0"), "");
+  options.add_option(group, "", "hot_scan", "num of lines of training file counted for hot_rows",
+                     cxxopts::value<uint32_t>()->default_value("1000000"), "");
+  options.add_option(group, "", "vocab",
+                     "file of vocabulary mapping feature ids to dense ids, whose rows are kept in "
+                     "an array, default: <load>.vocab if it exists",
+                     cxxopts::value<std::string>()->default_value(""), "");
+  options.add_option(group, "", "build_vocab",
+                     "build vocabulary of training file before training, saved to <save>.vocab",
+                     cxxopts::value<bool>()->default_value("false"), "");
+  options.add_option(group, "", "min_count",
+                     "ids occurring fewer times are left out of built vocabulary, and share the "
+                     "default row with unknown ids",
+                     cxxopts::value<uint32_t>()->default_value("1"), "");
+  options.add_option(group, "", "sweep",
+                     "file of model configs trained together on a single scan of data, a line of "
+                     "key=value overriding model, w_lr, v_lr, w_l2, v_l2, v_stddev, k, save or "
+                     "test_pred per config",
+                     cxxopts::value<std::string>()->default_value(""), "");
+  options.add_option(group, "", "neg_sample_rate",
+                     "keep this fraction of negatives of training file, a fixed hashed subsample "
+                     "per epoch, predictions are calibrated back by the rate saved in the model",
+                     cxxopts::value<double>()->default_value("1"), "");
+  options.add_option(group, "", "cache_in_memory",
+                     "keep samples parsed in the first epoch in memory, later epochs train on them "
+                     "without reading training file",
+                     cxxopts::value<bool>()->default_value("false"), "");
+  options.add_option(group, "", "shuffle",
+                     "with cache_in_memory, train later epochs on cached chunks of samples in "
+                     "shuffled order, each chunk shuffled too, by --seed and epoch",
+                     cxxopts::value<bool>()->default_value("false"), "");
+  options.add_option(group, "", "direct_io",
+                     "read data files with O_DIRECT, so they do not push other data out of page "
+                     "cache",
+                     cxxopts::value<bool>()->default_value("false"), "");
   options.add_options()("h,help", "printing this help message");
 
   try
@@ -353,12 +1558,58 @@ int main(int argc, char* argv[])
     cfg.train_thread_num = args["tt"].as<uint32_t>();
     cfg.seed             = args["seed"].as<long>();
     cfg.debug            = args["debug"].as<bool>();
+    cfg.stats_interval   = args["stats_interval"].as<double>();
+    cfg.stats_file       = args["stats_file"].as<string>();
+    cfg.trace_file       = args["trace"].as<string>();
+    cfg.max_model_mem    = args["max_model_mem"].as<double>();
+    cfg.mem_policy       = args["mem_policy"].as<string>();
+    cfg.role             = args["role"].as<string>();
+    cfg.ps               = args["ps"].as<string>();
+    cfg.ps_id            = args["ps_id"].as<uint32_t>();
+    cfg.worker_id        = args["worker_id"].as<uint32_t>();
+    cfg.num_workers      = args["num_workers"].as<uint32_t>();
+    cfg.numa             = args["numa"].as<bool>();
+    cfg.sharded          = args["sharded"].as<bool>();
+    cfg.package_size     = args["package_size"].as<uint32_t>();
+    cfg.queue_depth      = args["queue_depth"].as<uint32_t>();
+    cfg.autotune         = args["autotune"].as<bool>();
+    cfg.autotune_rows    = args["autotune_rows"].as<uint32_t>();
+    cfg.autotune_auc_tol = args["autotune_auc_tol"].as<double>();
+    cfg.autotune_save    = args["autotune_save"].as<string>();
+    cfg.deterministic    = args["deterministic"].as<bool>();
+    cfg.round_batches    = args["round_batches"].as<uint32_t>();
+    cfg.early_stop       = args["early_stop"].as<uint32_t>();
+    cfg.valid_sample     = args["valid_sample"].as<double>();
+    cfg.hot_rows         = args["hot_rows"].as<uint32_t>();
+    cfg.hot_scan         = args["hot_scan"].as<uint32_t>();
+    cfg.vocab            = args["vocab"].as<string>();
+    cfg.build_vocab      = args["build_vocab"].as<bool>();
+    cfg.min_count        = args["min_count"].as<uint32_t>();
+    cfg.sweep            = args["sweep"].as<string>();
+    cfg.neg_sample_rate  = args["neg_sample_rate"].as<double>();
+    cfg.cache_in_memory  = args["cache_in_memory"].as<bool>();
+    cfg.shuffle          = args["shuffle"].as<bool>();
+    cfg.direct_io        = args["direct_io"].as<bool>();
   } catch (cxxopts::exceptions::exception& exception)
   {
     cerr << "error parsing args: " << exception.what() << std::endl;
     exit(-1);
   }
 
+  string_split(cfg.ps, cfg.ps_servers, ",");
+  if (cfg.role == "worker" && cfg.worker_id != 0)
+  {
+    cfg.valid_file.clear();
+    cfg.save.clear();
+    cfg.test_file.clear();
+  }
+
+  if (cfg.vocab.empty() && !cfg.build_vocab && !cfg.load.empty()
+      && ifstream(cfg.load + ".vocab").good())
+    cfg.vocab = cfg.load + ".vocab";
+
+  if (!cfg.sweep.empty() && load_sweep())
+    exit(-1);
   if (check_args())
   {
     exit(-1);
@@ -372,5 +1623,7 @@ int main(int argc, char* argv[])
   spdlog::level::level_enum log_level = cfg.debug ? spdlog::level::debug : spdlog::level::info;
   spdlog::set_level(log_level);
 
+  if (cfg.role == "ps")
+    return run_ps();
   return run();
 }
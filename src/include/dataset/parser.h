@@ -1,16 +1,27 @@
 #ifndef FLATCTR_PARSER_H
 #define FLATCTR_PARSER_H
 
+#include <atomic>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <fcntl.h>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <unistd.h>
 
+#include "spdlog/spdlog.h"
+
 #include "common.h"
 #include "sample.h"
+#include "stats.h"
+#include "tokenizer.h"
+#include "trace.h"
+#include "worker/numa.h"
 
-#define BUF_SIZE (256 * 1024 * 1024)
+#define BUF_SIZE (16 * 1024 * 1024) // per block, a multiple of the block size of O_DIRECT
 
 #define handle_error(msg)                                                                          \
   do                                                                                               \
@@ -21,18 +32,48 @@
 
 using namespace std;
 
+// Splits lines of a file, read ahead by an io thread into N_BUFS buffers of BUF_SIZE, so reading
+// overlaps with splitting. A line cut by the end of a block is carried over to the next one.
 class Parser
 {
  private:
+  static constexpr int N_BUFS = 2;
+
   string file_name;
   int    fd;
-  char*  buf;
+  char*  bufs[N_BUFS];
+  long   sizes[N_BUFS]; // bytes read to each buffer, 0 past end of file
+  int    cur        = -1; // buffer being split
+  char*  buf        = nullptr;
   long   offset     = 0;
   long   bytes_read = 0;
+  bool   eof        = false;
+  string carry; // head of a line continued in the next block
+
+  // newlines of buf[nl_base, nl_base + 64) not returned yet
+  long     nl_base = -64;
+  uint64_t nl_mask = 0;
+
+  // buffers are handed between io thread and splitter by these queues, in file order
+  thread             io;
+  mutex              mtx;
+  condition_variable cv;
+  deque<int>         free_bufs;
+  deque<int>         full_bufs;
+  bool               stop = false;
+
+  void io_loop();
+
+  long read_block(int b, off_t pos);
+
+  bool next_block();
 
-  void read_block();
+  void halt();
 
  public:
+  static inline atomic<size_t> live_buffer_bytes{0};
+  static inline bool           direct_io = false; // read with O_DIRECT, bypassing page cache
+
   explicit Parser(const string& file_name);
 
   ~Parser();
@@ -42,58 +83,181 @@ class Parser
   unique_ptr<string> nextLine();
 };
 
-Parser::Parser(const string& file_name) : file_name(file_name)
+inline Parser::Parser(const string& file_name) : file_name(file_name)
 {
-  buf = new char[BUF_SIZE + 1];
-  fd  = open(file_name.c_str(), O_RDONLY);
+  fd = open(file_name.c_str(), O_RDONLY | (direct_io ? O_DIRECT : 0));
+  if (fd == -1 && direct_io)
+  {
+    spdlog::warn("{}: O_DIRECT not supported, read through page cache", file_name);
+    fd = open(file_name.c_str(), O_RDONLY);
+  }
   posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  for (int b = 0; b < N_BUFS; b++)
+  {
+    // a page more for the '\n' stopping newline scans
+    bufs[b] = Numa::alloc(BUF_SIZE + 4096);
+    if (bufs[b] == nullptr)
+      handle_error("alloc failed");
+  }
+  live_buffer_bytes += N_BUFS * (BUF_SIZE + 4096);
   reset();
 }
 
-void Parser::reset()
+// stops io thread, it is restarted from the beginning of file by reset
+inline void Parser::halt()
 {
-  lseek(fd, 0, SEEK_SET);
-  offset      = 0;
-  buf[offset] = '\0';
-  bytes_read  = 0;
+  if (!io.joinable())
+    return;
+  {
+    lock_guard<mutex> lck(mtx);
+    stop = true;
+  }
+  cv.notify_all();
+  io.join();
 }
 
-Parser::~Parser()
+inline void Parser::reset()
 {
+  halt();
+  free_bufs.clear();
+  full_bufs.clear();
+  for (int b = 0; b < N_BUFS; b++)
+    free_bufs.push_back(b);
+  stop       = false;
+  cur        = -1;
+  offset     = 0;
+  bytes_read = 0;
+  eof        = false;
+  carry.clear();
+  io = thread(&Parser::io_loop, this);
+}
+
+inline Parser::~Parser()
+{
+  halt();
   close(fd);
-  delete buf;
+  for (char* b : bufs)
+    Numa::free(b, BUF_SIZE + 4096);
+  live_buffer_bytes -= N_BUFS * (BUF_SIZE + 4096);
+}
+
+// fills buffer b from file offset pos, returns bytes read, less than BUF_SIZE at end of file
+inline long Parser::read_block(int b, off_t pos)
+{
+  TraceSpan span("read_block");
+  long      n = 0;
+  while (n < BUF_SIZE)
+  {
+    ssize_t r = pread(fd, bufs[b] + n, BUF_SIZE - n, pos + n);
+    if (r == -1)
+      handle_error("read failed");
+    if (r == 0)
+      break;
+    n += r;
+  }
+  return n;
+}
+
+inline void Parser::io_loop()
+{
+  Trace::set_thread_name("parser_io");
+  off_t pos  = 0;
+  bool  done = false;
+  while (true)
+  {
+    int b;
+    {
+      unique_lock<mutex> lck(mtx);
+      cv.wait(lck, [this] { return stop || !free_bufs.empty(); });
+      if (stop)
+        return;
+      b = free_bufs.front();
+      free_bufs.pop_front();
+    }
+    // a short read is the last one, offsets of O_DIRECT stay aligned until then
+    long n = done ? 0 : read_block(b, pos);
+    pos += n;
+    done = n < BUF_SIZE;
+    {
+      lock_guard<mutex> lck(mtx);
+      sizes[b] = n;
+      full_bufs.push_back(b);
+    }
+    cv.notify_all();
+    if (n == 0)
+      return;
+  }
 }
 
-void Parser::read_block()
+// hands the block split so far back to io thread and takes the next one, false at end of file
+inline bool Parser::next_block()
 {
-  bytes_read = read(fd, buf, BUF_SIZE);
-  if (bytes_read == -1)
-    handle_error("read failed");
-  if (bytes_read)
+  StatTimer          timer(Stats::READ_NS);
+  unique_lock<mutex> lck(mtx);
+  if (cur >= 0)
   {
-    long p = bytes_read - 1;
-    while (buf[p] != '\n')
-      p--;
-    lseek(fd, -(bytes_read - p - 1), SEEK_CUR);
-    bytes_read      = p + 1;
-    buf[bytes_read] = '\n';
+    free_bufs.push_back(cur);
+    cv.notify_all();
   }
+  cv.wait(lck, [this] { return !full_bufs.empty(); });
+  cur = full_bufs.front();
+  full_bufs.pop_front();
+  buf             = bufs[cur];
+  bytes_read      = sizes[cur];
+  buf[bytes_read] = '\n';
+  offset          = 0;
+  nl_base         = -64;
+  nl_mask         = 0;
+  return bytes_read > 0;
 }
 
-unique_ptr<string> Parser::nextLine()
+inline unique_ptr<string> Parser::nextLine()
 {
-  if (offset >= bytes_read) [[unlikely]]
+  while (true)
   {
-    read_block();
-    offset = 0;
-    if (!bytes_read)
-      return nullptr;
+    if (offset >= bytes_read) [[unlikely]]
+    {
+      if (eof || !next_block())
+      {
+        // the last line may have no '\n'
+        eof = true;
+        if (carry.empty())
+          return nullptr;
+        unique_ptr<string> line = make_unique<string>(std::move(carry));
+        carry.clear();
+        return line;
+      }
+    }
+    // lines are returned in order, so the next newline is the lowest bit left, buf[bytes_read] is
+    // a '\n' stopping the scan
+    while (nl_mask == 0)
+    {
+      nl_base += 64;
+      nl_mask = Tokenizer::match(buf + nl_base, min<long>(64, bytes_read + 1 - nl_base), '\n');
+    }
+    long nl = nl_base + __builtin_ctzll(nl_mask);
+    nl_mask &= nl_mask - 1;
+    if (nl == bytes_read) [[unlikely]]
+    {
+      // the line goes on in the next block
+      carry.append(buf + offset, nl - offset);
+      offset = nl;
+      continue;
+    }
+    unique_ptr<string> line;
+    if (carry.empty()) [[likely]]
+    {
+      line = make_unique<string>(buf + offset, nl - offset);
+    }
+    else
+    {
+      carry.append(buf + offset, nl - offset);
+      line = make_unique<string>(std::move(carry));
+      carry.clear();
+    }
+    offset = nl + 1;
+    return line;
   }
-  char* p                 = (char*)memchr(buf + offset, '\n', bytes_read - offset);
-  *p                      = '\0';
-  unique_ptr<string> line = make_unique<string>(buf + offset);
-  offset                  = p - buf + 1;
-  return line;
 }
 
 #endif
\ No newline at end of file
@@ -10,6 +10,8 @@
 #include "fast_float/fast_float.h"
 
 #include "common.h"
+#include "tokenizer.h"
+#include "vocab.h"
 
 using namespace std;
 
@@ -17,58 +19,34 @@ using SampleX = vector<pair<uint32_t, F>>;
 
 class Sample
 {
- private:
-  static uint32_t fast_atoi(char** pptr);
-
  public:
   uint32_t            y;
   unique_ptr<SampleX> x;
 
   Sample(uint32_t y, unique_ptr<SampleX> x);
-  explicit Sample(const string& line);
+
+  // nullptr if line is malformed, ids are mapped to dense ids by vocab if given
+  static unique_ptr<Sample> parse(const string& line, const Vocab* vocab = nullptr);
 
   [[nodiscard]] string to_string() const;
 
   ~Sample();
 };
 
-Sample::Sample(uint32_t y, unique_ptr<SampleX> x) : y(y), x(std::move(x)) {}
-
-Sample::Sample(const string& line)
-{
-  char* p = const_cast<char*>(line.c_str());
-
-  y = (*p++) - '0';
-
-  x = make_unique<SampleX>();
-  F val;
-  do
-  {
-    p++;
-    uint32_t idx = fast_atoi(&p);
-
-    auto answer = fast_float::from_chars(p + 1, p + 100, val);
-    x->push_back(make_pair(idx, val));
-    p = const_cast<char*>(answer.ptr);
-  } while (*(p) != '\0');
-}
+inline Sample::Sample(uint32_t y, unique_ptr<SampleX> x) : y(y), x(std::move(x)) {}
 
-// https://stackoverflow.com/questions/16826422/c-most-efficient-way-to-convert-string-to-int-faster-than-atoi
-uint32_t Sample::fast_atoi(char** pptr)
+inline unique_ptr<Sample> Sample::parse(const string& line, const Vocab* vocab)
 {
-  char* p = *pptr;
-
-  uint32_t val = 0;
-  while (*p != ':')
-  {
-    val = val * 10 + (*(p++) - '0');
-  }
-
-  *pptr = p;
-  return val;
+  uint32_t            y;
+  unique_ptr<SampleX> x = make_unique<SampleX>();
+  if (!Tokenizer::parse_line(line.data(), line.data() + line.size(), y, *x))
+    return nullptr;
+  if (vocab != nullptr)
+    vocab->remap(*x);
+  return make_unique<Sample>(y, std::move(x));
 }
 
-string Sample::to_string() const
+inline string Sample::to_string() const
 {
   static thread_local stringstream sstream;
   sstream.str(string());
@@ -80,6 +58,6 @@ string Sample::to_string() const
   return sstream.str();
 }
 
-Sample::~Sample() = default;
+inline Sample::~Sample() = default;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,157 @@
+#ifndef FLATCTR_SAMPLE_CACHE_H
+#define FLATCTR_SAMPLE_CACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "common.h"
+#include "sample.h"
+
+// Parsed samples in CSR arrays, row r is y[r] and features (ids[j], vals[j]) for j in
+// [offsets[r], offsets[r + 1]). Row r is keyed by base + r, unique over chunks of a cache.
+struct SampleChunk
+{
+  static constexpr size_t ROWS = 4096;
+
+  uint64_t         base = 0;
+  vector<uint8_t>  y;
+  vector<uint32_t> offsets{0};
+  vector<uint32_t> ids;
+  vector<F>        vals;
+
+  [[nodiscard]] size_t rows() const
+  {
+    return y.size();
+  }
+
+  [[nodiscard]] bool full() const
+  {
+    return rows() >= ROWS;
+  }
+
+  [[nodiscard]] uint64_t key(size_t r) const
+  {
+    return base + r;
+  }
+
+  void add(const Sample& sample)
+  {
+    y.push_back((uint8_t)sample.y);
+    for (auto& [i, xi] : *sample.x)
+    {
+      ids.push_back(i);
+      vals.push_back(xi);
+    }
+    offsets.push_back((uint32_t)ids.size());
+  }
+
+  // row r into sample, reusing its buffer of features
+  void get(size_t r, Sample& sample) const
+  {
+    sample.y = y[r];
+    sample.x->clear();
+    for (uint32_t j = offsets[r]; j < offsets[r + 1]; j++)
+      sample.x->emplace_back(ids[j], vals[j]);
+  }
+
+  [[nodiscard]] size_t bytes() const
+  {
+    return y.capacity() + offsets.capacity() * sizeof(uint32_t)
+           + ids.capacity() * sizeof(uint32_t) + vals.capacity() * sizeof(F);
+  }
+
+  void shrink()
+  {
+    y.shrink_to_fit();
+    offsets.shrink_to_fit();
+    ids.shrink_to_fit();
+    vals.shrink_to_fit();
+  }
+};
+
+// Samples of the training file parsed in its first epoch, so that later epochs neither read nor
+// parse it. Each train thread fills chunks of its own, so only a full chunk takes the lock.
+class SampleCache
+{
+ private:
+  mutex                           mtx;
+  vector<unique_ptr<SampleChunk>> chunks;
+  bool                            complete = false;
+  atomic<uint64_t>                n_keys{0};
+
+ public:
+  // an empty chunk with keys of its own
+  unique_ptr<SampleChunk> new_chunk()
+  {
+    auto chunk  = make_unique<SampleChunk>();
+    chunk->base = n_keys.fetch_add(SampleChunk::ROWS);
+    return chunk;
+  }
+
+  void add(unique_ptr<SampleChunk> chunk)
+  {
+    if (chunk->rows() == 0)
+      return;
+    chunk->shrink();
+    lock_guard<mutex> lck(mtx);
+    chunks.push_back(std::move(chunk));
+  }
+
+  // called after the first epoch, chunks are read only from then on
+  void finish()
+  {
+    complete = true;
+  }
+
+  [[nodiscard]] bool ready() const
+  {
+    return complete;
+  }
+
+  [[nodiscard]] size_t size() const
+  {
+    return chunks.size();
+  }
+
+  [[nodiscard]] const SampleChunk& chunk(size_t i) const
+  {
+    return *chunks[i];
+  }
+
+  [[nodiscard]] size_t rows() const
+  {
+    size_t n = 0;
+    for (auto& chunk : chunks)
+      n += chunk->rows();
+    return n;
+  }
+
+  [[nodiscard]] size_t bytes() const
+  {
+    size_t n = 0;
+    for (auto& chunk : chunks)
+      n += chunk->bytes();
+    return n;
+  }
+
+  // order of chunks of an epoch, permuted by seed if shuffle
+  [[nodiscard]] vector<size_t> order(bool shuffle, uint64_t seed) const
+  {
+    vector<size_t> idx(chunks.size());
+    iota(idx.begin(), idx.end(), 0);
+    if (shuffle)
+    {
+      mt19937_64 rng(seed);
+      std::shuffle(idx.begin(), idx.end(), rng);
+    }
+    return idx;
+  }
+};
+
+#endif //FLATCTR_SAMPLE_CACHE_H
@@ -0,0 +1,171 @@
+#ifndef FLATCTR_TOKENIZER_H
+#define FLATCTR_TOKENIZER_H
+
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+#include <utility>
+#include <vector>
+
+#include "fast_float/fast_float.h"
+
+#include "common.h"
+
+// Splits libsvm rows by bitmasks of separator positions, 64 bytes per compare with AVX-512 or two
+// with AVX2, instead of testing every byte, ids are decoded by SSE4.1 digit arithmetic. Rows are
+// validated, a malformed row is rejected instead of read past.
+class Tokenizer
+{
+ public:
+  // bit i is set if p[i] == c, for i < n <= 64, nothing at or after p + n is read
+  static uint64_t match(const char* p, size_t n, char c)
+  {
+#if defined(__AVX512BW__)
+    __mmask64 load = n == 64 ? ~0ULL : (1ULL << n) - 1;
+    __m512i   v    = _mm512_maskz_loadu_epi8(load, p);
+    return _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(c)) & load;
+#elif defined(__AVX2__)
+    alignas(32) char tmp[64];
+    if (n < 64)
+    {
+      memset(tmp, 0, sizeof(tmp));
+      memcpy(tmp, p, n);
+      p = tmp;
+    }
+    __m256i  cc = _mm256_set1_epi8(c);
+    __m256i  a  = _mm256_loadu_si256((const __m256i*)p);
+    __m256i  b  = _mm256_loadu_si256((const __m256i*)(p + 32));
+    uint32_t lo = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, cc));
+    uint32_t hi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, cc));
+    uint64_t m  = (uint64_t)hi << 32 | lo;
+    return n == 64 ? m : m & ((1ULL << n) - 1);
+#else
+    uint64_t m = 0;
+    for (size_t i = 0; i < n; i++)
+      m |= (uint64_t)(p[i] == c) << i;
+    return m;
+#endif
+  }
+
+  // Decimal of n digits, up to 10, converted 16 digits at a time: pairs, quads and octets of
+  // digits are combined by multiply-add.
+  static bool parse_id(const char* p, size_t n, uint32_t& id)
+  {
+    if (n == 0 || n > 10)
+      return false;
+#if defined(__SSE4_1__)
+    alignas(16) char d[16];
+    memset(d, '0', 16 - n);
+    memcpy(d + 16 - n, p, n);
+    return digits16(_mm_load_si128((const __m128i*)d), 16, id);
+#else
+    uint64_t val = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+      if ((uint8_t)(p[i] - '0') > 9)
+        return false;
+      val = val * 10 + (p[i] - '0');
+    }
+    if (val > UINT32_MAX)
+      return false;
+    id = (uint32_t)val;
+    return true;
+#endif
+  }
+
+  // Parses "y id:val id:val ..." of [p, end) into y and x, y is 0 or 1, separators are runs of
+  // spaces, a trailing '\r' is ignored. Returns false if the row is malformed.
+  static bool parse_line(const char* p, const char* end, uint32_t& y,
+                         std::vector<std::pair<uint32_t, F>>& x)
+  {
+    static thread_local std::vector<uint64_t> delims;
+
+    while (end > p && (end[-1] == '\r' || end[-1] == ' '))
+      end--;
+    size_t len = end - p;
+    if (len == 0 || (*p != '0' && *p != '1') || (len > 1 && p[1] != ' '))
+      return false;
+    y = *p - '0';
+    x.clear();
+
+    size_t n_words = (len + 63) / 64;
+    delims.resize(n_words + 1);
+    for (size_t w = 0; w < n_words; w++)
+    {
+      size_t n  = std::min<size_t>(64, len - w * 64);
+      delims[w] = match(p + w * 64, n, ' ') | match(p + w * 64, n, ':');
+    }
+    delims[n_words] = 1; // position n_words * 64 >= len stops the scan
+
+    // positions of spaces and colons in order, a feature is a space, digits, a colon, a value
+    size_t   w    = 0;
+    uint64_t m    = delims[0];
+    auto     next = [&]() -> size_t {
+      while (m == 0)
+        m = delims[++w];
+      size_t pos = w * 64 + __builtin_ctzll(m);
+      m &= m - 1;
+      return std::min(pos, len);
+    };
+
+    F      val;
+    size_t d = next();
+    while (d < len)
+    {
+      size_t begin = d + 1;
+      size_t c     = next();
+      if (c == begin && p[c] == ' ')
+      {
+        d = c;
+        continue;
+      }
+      if (c == len || p[c] != ':')
+        return false;
+      size_t e = next();
+      if (e < len && p[e] != ' ')
+        return false;
+
+      uint32_t idx;
+      size_t   n = c - begin;
+#if defined(__SSE4_1__)
+      bool ok = n - 1 < 10
+                && (c >= 16 ? digits16(_mm_loadu_si128((const __m128i*)(p + c - 16)), n, idx)
+                            : parse_id(p + begin, n, idx));
+#else
+      bool ok = parse_id(p + begin, n, idx);
+#endif
+      if (!ok)
+        return false;
+      auto answer = fast_float::from_chars(p + c + 1, p + e, val);
+      if (answer.ec != std::errc() || answer.ptr != p + e)
+        return false;
+      x.emplace_back(idx, val);
+      d = e;
+    }
+    return true;
+  }
+
+ private:
+#if defined(__SSE4_1__)
+  // decimal of the last n bytes of v, n <= 10
+  static bool digits16(__m128i v, size_t n, uint32_t& id)
+  {
+    __m128i index = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i keep  = _mm_cmpgt_epi8(index, _mm_set1_epi8((char)(15 - n)));
+    v            = _mm_and_si128(_mm_sub_epi8(v, _mm_set1_epi8('0')), keep);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(9)), v)) != 0xffff)
+      return false;
+    v = _mm_maddubs_epi16(v, _mm_set_epi8(1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10));
+    v = _mm_madd_epi16(v, _mm_set_epi16(1, 100, 1, 100, 1, 100, 1, 100));
+    v = _mm_packus_epi32(v, v);
+    v = _mm_madd_epi16(v, _mm_set_epi16(1, 10000, 1, 10000, 1, 10000, 1, 10000));
+    uint64_t val = (uint64_t)_mm_cvtsi128_si32(v) * 100000000 + _mm_extract_epi32(v, 1);
+    if (val > UINT32_MAX)
+      return false;
+    id = (uint32_t)val;
+    return true;
+  }
+#endif
+};
+
+#endif //FLATCTR_TOKENIZER_H
@@ -0,0 +1,86 @@
+#ifndef FLATCTR_VOCAB_H
+#define FLATCTR_VOCAB_H
+
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include "common.h"
+#include "flat_index.h"
+
+// Maps sparse feature ids to dense ids 1, ..., n, so that rows of a model can be indexed directly.
+// Dense id 0 is the default row, shared by all ids out of vocabulary. The file has the id of dense
+// id k on line k.
+class Vocab
+{
+ private:
+  FlatIndex             index;
+  std::vector<uint32_t> ids; // ids[k - 1] is mapped to k
+
+ public:
+  // ids in order of dense ids, must be unique
+  void build(std::vector<uint32_t> vocab_ids)
+  {
+    ids = std::move(vocab_ids);
+    index.build(ids);
+  }
+
+  // dense id of id, 0 if it is out of vocabulary
+  [[nodiscard]] uint32_t map(uint32_t id) const
+  {
+    return (uint32_t)(index.find(id) + 1);
+  }
+
+  template <typename X>
+  void remap(X& x) const
+  {
+    for (auto& [i, xi] : x)
+      i = map(i);
+  }
+
+  // num of rows of a model on dense ids, including the default row
+  [[nodiscard]] size_t rows() const
+  {
+    return ids.size() + 1;
+  }
+
+  [[nodiscard]] bool load(const std::string& fname)
+  {
+    std::ifstream         ifs(fname);
+    std::string           line;
+    std::vector<uint32_t> vocab_ids;
+    if (!ifs)
+    {
+      spdlog::error("can not open vocab {}", fname);
+      return false;
+    }
+    while (std::getline(ifs, line))
+    {
+      char*         end;
+      errno            = 0;
+      unsigned long id = strtoul(line.c_str(), &end, 10);
+      if (errno != 0 || end == line.c_str() || *end != '\0' || id > UINT32_MAX)
+      {
+        spdlog::error("vocab parse error, line {}: [{}]", vocab_ids.size() + 1, line);
+        return false;
+      }
+      vocab_ids.push_back((uint32_t)id);
+    }
+    build(std::move(vocab_ids));
+    return true;
+  }
+
+  int save(const std::string& fname) const
+  {
+    std::ofstream ofs(fname);
+    for (uint32_t id : ids)
+      ofs << id << '\n';
+    return ofs ? 0 : -1;
+  }
+};
+
+#endif //FLATCTR_VOCAB_H
@@ -0,0 +1,234 @@
+#ifndef FLATCTR_NET_H
+#define FLATCTR_NET_H
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include "common.h"
+
+// Blocking stream sockets for the parameter server. An address is either "unix:/path/to/sock" or
+// "host:port". Every message is a MsgHeader followed by len bytes of payload.
+
+enum MsgType : uint32_t
+{
+  MSG_PULL = 1, // [u8 create][ids]           -> [u8 found * n][F * dim * n_found]
+  MSG_PUSH,     // [ids][F * dim * n]
+  MSG_SAVE,     // [path]                     -> [i32 ret]
+  MSG_DONE,     // worker finished
+  MSG_SYNC,     // []                         -> [], after earlier messages of the connection applied
+};
+
+struct MsgHeader
+{
+  uint32_t type;
+  uint32_t len;
+};
+
+inline bool is_unix_addr(const std::string& addr)
+{
+  return addr.rfind("unix:", 0) == 0;
+}
+
+inline bool split_host_port(const std::string& addr, std::string& host, std::string& port)
+{
+  size_t pos = addr.rfind(':');
+  if (pos == std::string::npos)
+    return false;
+  host = addr.substr(0, pos);
+  port = addr.substr(pos + 1);
+  if (host.empty())
+    host = "0.0.0.0";
+  return true;
+}
+
+inline int listen_on(const std::string& addr)
+{
+  int fd;
+  if (is_unix_addr(addr))
+  {
+    std::string path = addr.substr(5);
+    sockaddr_un sa{};
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, path.c_str(), sizeof(sa.sun_path) - 1);
+    unlink(path.c_str());
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (sockaddr*)&sa, sizeof(sa)) < 0)
+      return -1;
+  }
+  else
+  {
+    std::string host, port;
+    addrinfo    hints{}, *res;
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+    if (!split_host_port(addr, host, port) || getaddrinfo(host.c_str(), port.c_str(), &hints, &res))
+      return -1;
+    fd     = socket(res->ai_family, res->ai_socktype, 0);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    int ret = bind(fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (fd < 0 || ret < 0)
+      return -1;
+  }
+  if (listen(fd, 128) < 0)
+    return -1;
+  return fd;
+}
+
+// retries for a while, so that workers can be started before servers
+inline int connect_to(const std::string& addr, int retries = 100)
+{
+  for (int i = 0; i < retries; i++, std::this_thread::sleep_for(std::chrono::milliseconds(100)))
+  {
+    int fd;
+    if (is_unix_addr(addr))
+    {
+      sockaddr_un sa{};
+      sa.sun_family = AF_UNIX;
+      strncpy(sa.sun_path, addr.substr(5).c_str(), sizeof(sa.sun_path) - 1);
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (connect(fd, (sockaddr*)&sa, sizeof(sa)) < 0)
+      {
+        close(fd);
+        continue;
+      }
+    }
+    else
+    {
+      std::string host, port;
+      addrinfo    hints{}, *res;
+      hints.ai_family   = AF_INET;
+      hints.ai_socktype = SOCK_STREAM;
+      if (!split_host_port(addr, host, port) || getaddrinfo(host.c_str(), port.c_str(), &hints, &res))
+        return -1;
+      fd      = socket(res->ai_family, res->ai_socktype, 0);
+      int ret = connect(fd, res->ai_addr, res->ai_addrlen);
+      freeaddrinfo(res);
+      if (ret < 0)
+      {
+        close(fd);
+        continue;
+      }
+      int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    return fd;
+  }
+  return -1;
+}
+
+inline bool send_all(int fd, const void* data, size_t n)
+{
+  const char* p = (const char*)data;
+  while (n > 0)
+  {
+    ssize_t ret = send(fd, p, n, MSG_NOSIGNAL);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    p += ret;
+    n -= ret;
+  }
+  return true;
+}
+
+inline bool recv_all(int fd, void* data, size_t n)
+{
+  char* p = (char*)data;
+  while (n > 0)
+  {
+    ssize_t ret = recv(fd, p, n, 0);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    p += ret;
+    n -= ret;
+  }
+  return true;
+}
+
+inline bool send_msg(int fd, MsgType type, const std::vector<char>& payload)
+{
+  MsgHeader header{type, (uint32_t)payload.size()};
+  return send_all(fd, &header, sizeof(header)) && send_all(fd, payload.data(), payload.size());
+}
+
+inline bool recv_msg(int fd, MsgHeader& header, std::vector<char>& payload)
+{
+  if (!recv_all(fd, &header, sizeof(header)))
+    return false;
+  payload.resize(header.len);
+  return recv_all(fd, payload.data(), header.len);
+}
+
+/*********************************************************
+*  message encoding                                      *
+*********************************************************/
+
+// Sorted ids are sent as a count and varint coded gaps, most gaps of a batch take 1-3 bytes
+// instead of 4.
+inline void encode_ids(const std::vector<uint32_t>& ids, std::vector<char>& out)
+{
+  uint32_t n = ids.size(), last = 0;
+  out.insert(out.end(), (char*)&n, (char*)&n + sizeof(n));
+  for (uint32_t id : ids)
+  {
+    uint32_t gap = id - last;
+    last         = id;
+    while (gap >= 0x80)
+    {
+      out.push_back((char)(gap | 0x80));
+      gap >>= 7;
+    }
+    out.push_back((char)gap);
+  }
+}
+
+inline const char* decode_ids(const char* p, const char* end, std::vector<uint32_t>& ids)
+{
+  uint32_t n, last = 0;
+  if (end - p < (long)sizeof(n))
+    return nullptr;
+  memcpy(&n, p, sizeof(n));
+  p += sizeof(n);
+  ids.resize(n);
+  for (uint32_t i = 0; i < n; i++)
+  {
+    uint32_t gap = 0;
+    for (int shift = 0;; shift += 7)
+    {
+      if (p == end || shift > 28)
+        return nullptr;
+      uint8_t b = *p++;
+      gap |= (uint32_t)(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        break;
+    }
+    last += gap;
+    ids[i] = last;
+  }
+  return p;
+}
+
+inline void encode_floats(const F* data, size_t n, std::vector<char>& out)
+{
+  out.insert(out.end(), (const char*)data, (const char*)(data + n));
+}
+
+#endif //FLATCTR_NET_H
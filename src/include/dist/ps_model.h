@@ -0,0 +1,290 @@
+#ifndef FLATCTR_PS_MODEL_H
+#define FLATCTR_PS_MODEL_H
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+
+#include "spdlog/spdlog.h"
+
+#include "model/base_model.h"
+#include "net.h"
+#include "trace.h"
+
+// Worker side of the parameter server. Rows of each batch are pulled from the servers owning them
+// into a thread-local model, learned there, and the differences are pushed back, so the servers
+// only ever add deltas. One connection per server per thread, requests to all servers are sent
+// before any reply is read.
+class PSModel : public Base
+{
+ private:
+  struct ThreadContext
+  {
+    std::vector<int>                   fds;
+    std::unique_ptr<Base>              local;
+    std::vector<std::vector<uint32_t>> shard_ids;
+    std::vector<uint32_t>              ids;
+    std::vector<uint32_t>              found;
+    std::vector<F>                     rows;
+    std::vector<F>                     row;
+    std::vector<char>                  buf;
+
+    ~ThreadContext()
+    {
+      for (int fd : fds)
+        close(fd);
+    }
+  };
+
+  std::vector<std::string>               servers;
+  std::function<std::unique_ptr<Base>()> make_local;
+  size_t                                 dim;
+
+  static inline thread_local std::unique_ptr<ThreadContext> context;
+
+  [[nodiscard]] size_t shard_of(uint32_t idx) const
+  {
+    if (idx == BIAS_ROW)
+      return 0;
+    return ((uint64_t)(idx * 2654435761u) * servers.size()) >> 32;
+  }
+
+  ThreadContext& ctx()
+  {
+    if (context == nullptr) [[unlikely]]
+    {
+      context        = std::make_unique<ThreadContext>();
+      context->local = make_local();
+      context->shard_ids.resize(servers.size());
+      context->row.resize(dim);
+      for (auto& server : servers)
+      {
+        int fd = connect_to(server);
+        if (fd < 0)
+        {
+          spdlog::error("can not connect to parameter server {}", server);
+          exit(-1);
+        }
+        context->fds.push_back(fd);
+      }
+    }
+    return *context;
+  }
+
+  static void check(bool ok, const char* what)
+  {
+    if (!ok) [[unlikely]]
+    {
+      spdlog::error("parameter server {} failed: {}", what, strerror(errno));
+      exit(-1);
+    }
+  }
+
+  // ids must be sorted and unique, found rows are appended to c.found and c.rows
+  void pull(ThreadContext& c, const std::vector<uint32_t>& ids, bool create)
+  {
+    TraceSpan span("pull");
+    for (auto& v : c.shard_ids)
+      v.clear();
+    for (uint32_t idx : ids)
+      c.shard_ids[shard_of(idx)].push_back(idx);
+    for (size_t s = 0; s < servers.size(); s++)
+    {
+      c.buf.assign(1, (char)create);
+      encode_ids(c.shard_ids[s], c.buf);
+      check(send_msg(c.fds[s], MSG_PULL, c.buf), "pull");
+    }
+
+    c.found.clear();
+    c.rows.clear();
+    MsgHeader header{};
+    for (size_t s = 0; s < servers.size(); s++)
+    {
+      const std::vector<uint32_t>& shard_ids = c.shard_ids[s];
+      check(recv_msg(c.fds[s], header, c.buf) && header.type == MSG_PULL
+                && c.buf.size() >= shard_ids.size(),
+            "pull");
+      size_t n_found = std::count_if(c.buf.begin(), c.buf.begin() + (long)shard_ids.size(),
+                                     [](char f) { return f != 0; });
+      check(c.buf.size() == shard_ids.size() + n_found * dim * sizeof(F), "pull");
+      const char*                  row       = c.buf.data() + shard_ids.size();
+      for (size_t i = 0; i < shard_ids.size(); i++)
+      {
+        if (!c.buf[i])
+          continue;
+        c.found.push_back(shard_ids[i]);
+        c.rows.resize(c.rows.size() + dim);
+        memcpy(c.rows.data() + c.rows.size() - dim, row, dim * sizeof(F));
+        row += dim * sizeof(F);
+      }
+    }
+  }
+
+  // ids must be sorted and unique
+  void push(ThreadContext& c, const std::vector<uint32_t>& ids, const std::vector<F>& deltas)
+  {
+    TraceSpan span("push");
+    for (auto& v : c.shard_ids)
+      v.clear();
+    for (uint32_t idx : ids)
+      c.shard_ids[shard_of(idx)].push_back(idx);
+    for (size_t s = 0; s < servers.size(); s++)
+    {
+      if (c.shard_ids[s].empty())
+        continue;
+      c.buf.clear();
+      encode_ids(c.shard_ids[s], c.buf);
+      for (size_t i = 0; i < ids.size(); i++)
+        if (shard_of(ids[i]) == s)
+          encode_floats(deltas.data() + i * dim, dim, c.buf);
+      check(send_msg(c.fds[s], MSG_PUSH, c.buf), "push");
+    }
+  }
+
+  // pulls rows of all features in samples into the local model
+  ThreadContext& fetch(const std::vector<std::unique_ptr<Sample>>& samples, bool create)
+  {
+    ThreadContext& c = ctx();
+    c.ids.clear();
+    for (auto& sample : samples)
+      for (auto& [i, xi] : *(sample->x))
+        c.ids.push_back(i);
+    c.ids.push_back(BIAS_ROW);
+    std::sort(c.ids.begin(), c.ids.end());
+    c.ids.erase(std::unique(c.ids.begin(), c.ids.end()), c.ids.end());
+
+    pull(c, c.ids, create);
+    c.local->clear();
+    for (size_t k = 0; k < c.found.size(); k++)
+      c.local->set_row(c.found[k], c.rows.data() + k * dim);
+    return c;
+  }
+
+ public:
+  PSModel(std::vector<std::string> servers, std::function<std::unique_ptr<Base>()> make_local)
+  : servers(std::move(servers)), make_local(std::move(make_local))
+  {
+    dim = this->make_local()->row_dim();
+  }
+
+  void learn(const std::vector<std::unique_ptr<Sample>>& sample_batch) override
+  {
+    ThreadContext& c = fetch(sample_batch, true);
+    c.local->learn(sample_batch);
+    for (size_t k = 0; k < c.found.size(); k++)
+    {
+      c.local->get_row(c.found[k], c.row.data(), false);
+      for (size_t d = 0; d < dim; d++)
+        c.rows[k * dim + d] = c.row[d] - c.rows[k * dim + d];
+    }
+    push(c, c.found, c.rows);
+  }
+
+  F predict_prob(const std::unique_ptr<Sample>& sample) override
+  {
+    static thread_local std::vector<std::unique_ptr<Sample>> samples(1);
+    static thread_local std::vector<F>                       preds;
+    samples[0] = std::make_unique<Sample>(sample->y, std::make_unique<SampleX>(*sample->x));
+    predict_batch(samples, preds);
+    return preds[0];
+  }
+
+  void predict_batch(const std::vector<std::unique_ptr<Sample>>& samples,
+                     std::vector<F>&                          preds) override
+  {
+    ThreadContext& c = fetch(samples, false);
+    c.local->predict_batch(samples, preds);
+  }
+
+  size_t load(const std::string& fname) override
+  {
+    spdlog::error("{}: models are loaded by parameter servers", fname);
+    return 0;
+  }
+
+  // each server saves its shard to fname.ps<i>
+  int save(const std::string& fname) override
+  {
+    ThreadContext&    c = ctx();
+    MsgHeader         header{};
+    std::vector<char> payload;
+    int               ret = 0;
+    for (size_t s = 0; s < servers.size(); s++)
+    {
+      std::string path = fname + ".ps" + std::to_string(s);
+      check(send_msg(c.fds[s], MSG_SAVE, std::vector<char>(path.begin(), path.end())), "save");
+    }
+    for (size_t s = 0; s < servers.size(); s++)
+    {
+      int shard_ret;
+      check(recv_msg(c.fds[s], header, payload) && payload.size() == sizeof(int), "save");
+      memcpy(&shard_ret, payload.data(), sizeof(int));
+      ret |= shard_ret;
+    }
+    return ret;
+  }
+
+  // Pushes are sent without waiting for replies, so before its thread ends they are flushed: a
+  // server acks a sync only after applying all earlier messages of the connection.
+  void thread_end() override
+  {
+    if (context == nullptr)
+      return;
+    ThreadContext& c = *context;
+    MsgHeader      header{};
+    for (int fd : c.fds)
+      check(send_msg(fd, MSG_SYNC, {}), "sync");
+    for (int fd : c.fds)
+      check(recv_msg(fd, header, c.buf) && header.type == MSG_SYNC, "sync");
+  }
+
+  // tells servers this worker is done, servers exit after all workers are done
+  void finish()
+  {
+    ThreadContext& c = ctx();
+    for (int fd : c.fds)
+      check(send_msg(fd, MSG_DONE, {}), "done");
+  }
+
+  MemInfo mem_info() override
+  {
+    return {};
+  }
+
+  size_t evict(size_t) override
+  {
+    return 0;
+  }
+
+  size_t row_dim() override
+  {
+    return dim;
+  }
+
+  bool get_row(uint32_t idx, F* row, bool create) override
+  {
+    ThreadContext& c = ctx();
+    pull(c, {idx}, create);
+    if (c.found.empty())
+      return false;
+    std::copy(c.rows.begin(), c.rows.begin() + dim, row);
+    return true;
+  }
+
+  void set_row(uint32_t, const F*) override
+  {
+    spdlog::error("set_row is not supported by parameter server");
+  }
+
+  void add_row(uint32_t idx, const F* delta) override
+  {
+    push(ctx(), {idx}, std::vector<F>(delta, delta + dim));
+  }
+
+  void clear() override
+  {
+    spdlog::error("clear is not supported by parameter server");
+  }
+};
+
+#endif //FLATCTR_PS_MODEL_H
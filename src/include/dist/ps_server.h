@@ -0,0 +1,153 @@
+#ifndef FLATCTR_PS_SERVER_H
+#define FLATCTR_PS_SERVER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "spdlog/spdlog.h"
+
+#include "model/base_model.h"
+#include "net.h"
+
+// Holds one shard of the model and serves pulls and pushes of workers, one thread per connection.
+class PSServer
+{
+ private:
+  Base*                 model;
+  std::string           addr;
+  size_t                num_workers;
+  std::function<void()> maintain; // called every 64 creating pulls, e.g. to enforce memory budget
+
+  std::mutex              mtx;
+  std::condition_variable all_done;
+  size_t                  n_done     = 0;
+  size_t                  n_handlers = 0;
+  std::atomic<size_t>     n_pulls{0};
+  std::mutex              maintain_mtx;
+
+  void handle(int fd)
+  {
+    size_t                dim = model->row_dim();
+    MsgHeader             header{};
+    std::vector<char>     payload, out;
+    std::vector<uint32_t> ids;
+    std::vector<F>        row(dim);
+    while (recv_msg(fd, header, payload))
+    {
+      const char* p   = payload.data();
+      const char* end = p + payload.size();
+      if (header.type == MSG_PULL)
+      {
+        bool create = p != end && *p++;
+        if ((p = decode_ids(p, end, ids)) == nullptr)
+          break;
+        out.assign(ids.size(), 0);
+        for (size_t i = 0; i < ids.size(); i++)
+        {
+          if (model->get_row(ids[i], row.data(), create))
+          {
+            out[i] = 1;
+            encode_floats(row.data(), dim, out);
+          }
+        }
+        if (!send_msg(fd, MSG_PULL, out))
+          break;
+        if (create && ++n_pulls % 64 == 0 && maintain_mtx.try_lock())
+        {
+          maintain();
+          maintain_mtx.unlock();
+        }
+      }
+      else if (header.type == MSG_PUSH)
+      {
+        if ((p = decode_ids(p, end, ids)) == nullptr
+            || (size_t)(end - p) != ids.size() * dim * sizeof(F))
+          break;
+        for (size_t i = 0; i < ids.size(); i++)
+        {
+          memcpy(row.data(), p + i * dim * sizeof(F), dim * sizeof(F));
+          model->add_row(ids[i], row.data());
+        }
+      }
+      else if (header.type == MSG_SAVE)
+      {
+        std::string path(p, end);
+        spdlog::info("save to {}", path);
+        int ret = model->save(path);
+        out.assign((char*)&ret, (char*)&ret + sizeof(ret));
+        if (!send_msg(fd, MSG_SAVE, out))
+          break;
+      }
+      else if (header.type == MSG_SYNC)
+      {
+        out.clear();
+        if (!send_msg(fd, MSG_SYNC, out))
+          break;
+      }
+      else if (header.type == MSG_DONE)
+      {
+        std::lock_guard<std::mutex> lck(mtx);
+        n_done++;
+        spdlog::info("{}/{} workers done", n_done, num_workers);
+        all_done.notify_one();
+      }
+      else
+      {
+        break;
+      }
+    }
+    close(fd);
+    std::lock_guard<std::mutex> lck(mtx);
+    n_handlers--;
+    all_done.notify_one();
+  }
+
+ public:
+  PSServer(Base* model, std::string addr, size_t num_workers, std::function<void()> maintain)
+  : model(model), addr(std::move(addr)), num_workers(num_workers), maintain(std::move(maintain))
+  {
+  }
+
+  // returns after all workers are done and all of their connections are closed, so every push has
+  // been applied
+  int serve()
+  {
+    int listen_fd = listen_on(addr);
+    if (listen_fd < 0)
+    {
+      spdlog::error("can not listen on {}: {}", addr, strerror(errno));
+      return -1;
+    }
+    spdlog::info("parameter server listening on {}, waiting for {} workers", addr, num_workers);
+
+    std::thread acceptor([this, listen_fd] {
+      while (true)
+      {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+          break;
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        {
+          std::lock_guard<std::mutex> lck(mtx);
+          n_handlers++;
+        }
+        std::thread(&PSServer::handle, this, fd).detach();
+      }
+    });
+
+    {
+      std::unique_lock<std::mutex> lck(mtx);
+      all_done.wait(lck, [this] { return n_done >= num_workers && n_handlers == 0; });
+    }
+    shutdown(listen_fd, SHUT_RDWR);
+    acceptor.join();
+    close(listen_fd);
+    return 0;
+  }
+};
+
+#endif //FLATCTR_PS_SERVER_H
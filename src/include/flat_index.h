@@ -0,0 +1,61 @@
+#ifndef FLATCTR_FLAT_INDEX_H
+#define FLATCTR_FLAT_INDEX_H
+
+#include <cstdint>
+#include <vector>
+
+#include "hash_rng.h"
+
+// Open addressing map from ids to their positions in a list, built once and then only read, so
+// lookups take no lock.
+class FlatIndex
+{
+ private:
+  struct Slot
+  {
+    uint32_t id;
+    uint32_t pos; // pos + 1, 0: empty
+  };
+
+  std::vector<Slot> slots;
+  size_t            mask = 0;
+
+ public:
+  // pos of ids[k] is k, ids must be unique
+  void build(const std::vector<uint32_t>& ids)
+  {
+    size_t size = 16;
+    while (size < ids.size() * 2)
+      size *= 2;
+    slots.assign(size, Slot{0, 0});
+    mask = size - 1;
+    for (size_t pos = 0; pos < ids.size(); pos++)
+    {
+      size_t h = mix64(ids[pos]) & mask;
+      while (slots[h].pos != 0)
+        h = (h + 1) & mask;
+      slots[h] = Slot{ids[pos], (uint32_t)(pos + 1)};
+    }
+  }
+
+  // -1 if id is not in the list
+  [[nodiscard]] long find(uint32_t id) const
+  {
+    if (slots.empty())
+      return -1;
+    for (size_t h = mix64(id) & mask;; h = (h + 1) & mask)
+    {
+      if (slots[h].pos == 0)
+        return -1;
+      if (slots[h].id == id)
+        return slots[h].pos - 1;
+    }
+  }
+
+  [[nodiscard]] size_t bytes() const
+  {
+    return slots.size() * sizeof(Slot);
+  }
+};
+
+#endif //FLATCTR_FLAT_INDEX_H
@@ -0,0 +1,30 @@
+#ifndef FLATCTR_HASH_RNG_H
+#define FLATCTR_HASH_RNG_H
+
+#include <cmath>
+#include <cstdint>
+
+#include "common.h"
+
+// splitmix64 finalizer
+inline uint64_t mix64(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+// Counter-based standard normal variate, a pure function of (seed, key, j), so the value does not
+// depend on which thread draws it or in which order.
+inline double hash_gauss(uint64_t seed, uint64_t key, uint64_t j)
+{
+  uint64_t h  = mix64(mix64(seed ^ 0x9e3779b97f4a7c15ULL) ^ (key << 16) ^ j);
+  double   u1 = (double)((h >> 11) + 1) * 0x1.0p-53;
+  double   u2 = (double)(mix64(h) >> 11) * 0x1.0p-53;
+  return std::sqrt(-2 * std::log(u1)) * std::cos(2 * M_PI * u2);
+}
+
+#endif //FLATCTR_HASH_RNG_H
@@ -0,0 +1,69 @@
+#ifndef FLATCTR_MEM_USAGE_H
+#define FLATCTR_MEM_USAGE_H
+
+#include <algorithm>
+#include <cstdio>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <utility>
+
+#define MB (1024.0 * 1024.0)
+
+struct MemInfo
+{
+  size_t rows        = 0;
+  size_t table_bytes = 0; // slots and locks of hash table
+  size_t heap_bytes  = 0; // heap memory owned by rows, e.g. embedding vectors
+  double load_factor = 0;
+  size_t hot_rows    = 0; // rows of dense tier, not counted in rows, never evicted
+  size_t hot_bytes   = 0;
+
+  [[nodiscard]] size_t bytes() const
+  {
+    return table_bytes + heap_bytes + hot_bytes;
+  }
+
+  [[nodiscard]] double bytes_per_row() const
+  {
+    return rows ? (double)bytes() / (double)rows : 0;
+  }
+};
+
+// libcuckoo keeps a partial key and an occupied flag next to each slot, and a 64B aligned
+// spinlock per bucket up to 65536 locks.
+template <typename Map>
+size_t cuckoo_table_bytes(const Map& map)
+{
+  using Slot         = std::pair<typename Map::key_type, typename Map::mapped_type>;
+  size_t n_buckets   = map.bucket_count();
+  size_t n_locks     = std::min(n_buckets, (size_t)1 << 16);
+  size_t bucket_size = (sizeof(Slot) + 2) * Map::slot_per_bucket();
+  return n_buckets * bucket_size + n_locks * 64;
+}
+
+// glibc malloc rounds a request up to 16B chunks with 8B header, 32B at least
+inline size_t malloc_bytes(size_t n)
+{
+  return std::max((size_t)32, (n + 8 + 15) / 16 * 16);
+}
+
+inline size_t rss_bytes()
+{
+  long  pages = 0;
+  FILE* fp    = fopen("/proc/self/statm", "r");
+  if (fp == nullptr)
+    return 0;
+  if (fscanf(fp, "%*d %ld", &pages) != 1)
+    pages = 0;
+  fclose(fp);
+  return pages * sysconf(_SC_PAGESIZE);
+}
+
+inline size_t peak_rss_bytes()
+{
+  struct rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss * 1024;
+}
+
+#endif //FLATCTR_MEM_USAGE_H
@@ -7,12 +7,12 @@
 
 #include "common.h"
 
-bool cmp_by_val(const std::pair<int, F>& a, const std::pair<int, F>& b)
+inline bool cmp_by_val(const std::pair<int, F>& a, const std::pair<int, F>& b)
 {
   return (a.second < b.second);
 }
 
-double calc_auc(const std::vector<F>& y_pred, const std::vector<int>& y_true)
+inline double calc_auc(const std::vector<F>& y_pred, const std::vector<int>& y_true)
 {
   assert(y_pred.size() == y_true.size() && "length of y_pred not equal to length of y_true");
   std::vector<std::pair<int, F>> lst;
@@ -1,8 +1,46 @@
 #ifndef FLATCTR_BASE_MODEL_H
 #define FLATCTR_BASE_MODEL_H
 
+#include <atomic>
+#include <istream>
+#include <limits>
+#include <ostream>
+
+#include "spdlog/spdlog.h"
+
 #include "common.h"
 #include "dataset/sample.h"
+#include "mem_usage.h"
+
+#define BIAS_ROW UINT32_MAX // row id of bias in row access
+
+// Factor of l2 decay pending for steps sgd steps, log_keep = log(1 - lr * l2) of each step, 0 if
+// there is no l2. Rows are decayed lazily in closed form when touched instead of every step.
+inline F l2_decay(double log_keep, uint32_t steps)
+{
+  if (steps == 0 || log_keep == 0)
+    return 1;
+  return (F)std::exp(log_keep * steps);
+}
+
+// Steps of l2 decay pending on a row stamped at row_step. Under concurrent training a thread may
+// find a row already stamped by one that took a later step, then nothing is pending.
+inline uint32_t pending_steps(uint32_t now, uint32_t row_step)
+{
+  auto d = (int32_t)(now - row_step);
+  return d > 0 ? (uint32_t)d : 0;
+}
+
+// stamp of a row brought up to now, never moved backwards
+inline uint32_t later_step(uint32_t now, uint32_t row_step)
+{
+  return pending_steps(now, row_step) > 0 ? now : row_step;
+}
+
+inline double l2_log_keep(F lr, F l2)
+{
+  return l2 > 0 ? std::log1p(-(double)lr * l2) : 0;
+}
 
 inline F sigmoid(F t)
 {
@@ -11,17 +49,206 @@ inline F sigmoid(F t)
   return 1.0f / (1.0f + std::exp(-t));
 }
 
+// Gradients of one batch in deterministic training, rows of dim floats in a layout of the model,
+// grouped by bucket of id, so that threads can apply disjoint buckets.
+struct GradBuffer
+{
+  static constexpr size_t N_BUCKETS = 64;
+
+  size_t                dim  = 0;
+  uint32_t              seq  = 0; // index of batch in its round
+  F                     bias = 0;
+  std::vector<uint32_t> ids;
+  std::vector<F>        rows;
+  std::vector<uint32_t> bucket_begin; // N_BUCKETS + 1 offsets into ids
+
+  static size_t bucket_of(uint32_t idx)
+  {
+    return (uint32_t)(idx * 2654435761u) >> 26;
+  }
+
+  // groups rows appended to ids and rows by bucket, keeping their order within a bucket
+  void group()
+  {
+    static thread_local std::vector<uint32_t> tmp_ids;
+    static thread_local std::vector<F>        tmp_rows;
+
+    bucket_begin.assign(N_BUCKETS + 1, 0);
+    for (uint32_t idx : ids)
+      bucket_begin[bucket_of(idx) + 1]++;
+    for (size_t k = 0; k < N_BUCKETS; k++)
+      bucket_begin[k + 1] += bucket_begin[k];
+    std::vector<uint32_t> pos(bucket_begin.begin(), bucket_begin.end() - 1);
+    tmp_ids.resize(ids.size());
+    tmp_rows.resize(rows.size());
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+      uint32_t to = pos[bucket_of(ids[i])]++;
+      tmp_ids[to] = ids[i];
+      std::copy(rows.begin() + i * dim, rows.begin() + (i + 1) * dim, tmp_rows.begin() + to * dim);
+    }
+    ids.swap(tmp_ids);
+    rows.swap(tmp_rows);
+  }
+};
+
 class Base
 {
- private:
+ protected:
+  size_t                max_mem = 0; // bytes of model store, 0: unlimited
+  std::atomic<bool>     mem_full{false};
+  std::atomic<uint32_t> step{0}; // sgd steps taken, rows keep the step of their last update
+  double                neg_rate = 1; // negatives were kept at this rate in training
+
+  // Prediction of a model trained on negatives kept at neg_rate, corrected to the rate of the full
+  // data, p / (p + (1 - p) / neg_rate).
+  [[nodiscard]] F calibrate(F p) const
+  {
+    return neg_rate < 1 ? p / (p + (1 - p) / (F)neg_rate) : p;
+  }
+
+  // optional first line of a model file, "neg_sample_rate\t<rate>", written if neg_rate < 1
+  void save_neg_rate(std::ostream& os) const
+  {
+    if (neg_rate < 1)
+      os << "neg_sample_rate\t" << neg_rate << std::endl;
+  }
+
+  // reads the line of save_neg_rate if present, or leaves is as it is, false if it is malformed
+  bool load_neg_rate(std::istream& is)
+  {
+    std::streampos begin = is.tellg();
+    std::string    key;
+    neg_rate = 1;
+    if (!(is >> key) || key != "neg_sample_rate")
+    {
+      is.clear();
+      is.seekg(begin);
+      return true;
+    }
+    if (!(is >> neg_rate) || !(neg_rate > 0 && neg_rate <= 1))
+    {
+      spdlog::error("model parse error. @neg_sample_rate");
+      return false;
+    }
+    is.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    return true;
+  }
+
+  // rows are not inserted when memory budget is reached
+  [[nodiscard]] bool accept_new_row() const
+  {
+    return !mem_full.load(std::memory_order_relaxed);
+  }
+
  public:
   virtual void learn(const std::vector<std::unique_ptr<Sample>>& sample_batch) = 0;
 
   virtual F predict_prob(const std::unique_ptr<Sample>& sample) = 0;
 
+  // called before n train threads of an epoch start, and by each of them with its id on start and
+  // after its last learn
+  virtual void start_threads(size_t) {}
+
+  virtual void thread_begin(size_t) {}
+
+  virtual void thread_end() {}
+
+  // Deterministic training: gradients of a batch are computed against the current weights without
+  // updating them, and applied later one bucket at a time, bias with bucket 0. Batch seq of a round
+  // is applied as step + seq + 1, and step is advanced by add_steps after the round.
+  virtual void compute_grad(const std::vector<std::unique_ptr<Sample>>&, GradBuffer&)
+  {
+    spdlog::error("deterministic training is not supported by this model");
+    exit(-1);
+  }
+
+  virtual void apply_grad(const GradBuffer&, size_t) {}
+
+  // moves rows of ids to a dense tier kept apart from the hash table, see HotStore
+  virtual void set_hot_rows(const std::vector<uint32_t>&)
+  {
+    spdlog::error("hot rows are not supported by this model");
+    exit(-1);
+  }
+
+  // moves rows of ids 0, ..., n - 1 to an array indexed by id, for ids mapped by Vocab
+  virtual void set_dense_rows(size_t)
+  {
+    spdlog::error("dense rows are not supported by this model");
+    exit(-1);
+  }
+
+  void add_steps(uint32_t n)
+  {
+    step += n;
+  }
+
+  // negatives are kept at rate in training, so predictions are calibrated back
+  void set_neg_sample_rate(double rate)
+  {
+    neg_rate = rate;
+  }
+
+  virtual void predict_batch(const std::vector<std::unique_ptr<Sample>>& samples,
+                             std::vector<F>&                          preds)
+  {
+    preds.resize(samples.size());
+    for (size_t i = 0; i < samples.size(); i++)
+      preds[i] = predict_prob(samples[i]);
+  }
+
   virtual size_t load(const std::string& fname) = 0;
 
   virtual int save(const std::string& fname) = 0;
+
+  virtual MemInfo mem_info() = 0;
+
+  // Row access for parameter server. A row is [w] for LR and [w, v_0, ..., v_{k-1}] for FM, row
+  // BIAS_ROW is [bias, 0, ...]. get_row initializes missing rows if create is set.
+  virtual size_t row_dim() = 0;
+
+  virtual bool get_row(uint32_t idx, F* row, bool create) = 0;
+
+  virtual void set_row(uint32_t idx, const F* row) = 0;
+
+  virtual void add_row(uint32_t idx, const F* delta) = 0;
+
+  virtual void clear() = 0;
+
+  // erase n rows of smallest magnitude, returns num of erased rows
+  virtual size_t evict(size_t n) = 0;
+
+  void set_max_mem(size_t bytes)
+  {
+    max_mem = bytes;
+  }
+
+  // Refreshes the budget flag checked before inserting new rows, returns num of rows to evict to
+  // get back to 90% of the budget. The table doubles when it is nearly full, so that is counted
+  // ahead of time.
+  size_t check_mem()
+  {
+    if (max_mem == 0)
+      return 0;
+    MemInfo info     = mem_info();
+    bool    doubling = info.load_factor > 0.9;
+    size_t  bytes    = info.bytes() + (doubling ? info.table_bytes : 0);
+    mem_full.store(bytes >= max_mem, std::memory_order_relaxed);
+    if (bytes < max_mem || info.rows == 0)
+      return 0;
+
+    double heap_per_row = (double)info.heap_bytes / (double)info.rows;
+    double target       = (double)info.rows;
+    size_t fixed_bytes  = info.table_bytes + info.hot_bytes;
+    if (fixed_bytes < max_mem && heap_per_row > 0)
+      target = std::min(target, (double)(max_mem - fixed_bytes) / heap_per_row);
+    if (doubling)
+      target = std::min(target, (double)info.rows * 0.9 / info.load_factor);
+    if (target >= (double)info.rows) // table itself exceeds the budget, only refuse new rows
+      return 0;
+    return info.rows - (size_t)(target * 0.9);
+  }
 };
 
 #endif //FLATCTR_BASE_MODEL_H
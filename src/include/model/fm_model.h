@@ -2,9 +2,11 @@
 #define FLATCTR_FM_MODEL_H
 
 #include <cstdlib>
+#include <fstream>
 #include <immintrin.h>
 #include <map>
 #include <memory>
+#include <random>
 #include <unordered_map>
 
 #include "libcuckoo/cuckoohash_map.hh"
@@ -12,11 +14,17 @@
 #include "base_model.h"
 #include "common.h"
 #include "dataset/sample.h"
+#include "hash_rng.h"
+#include "hot_store.h"
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
 
 class FM_weight
 {
  public:
-  F              w = 0;
+  F              w    = 0;
+  uint32_t       step = 0; // of last update, l2 decay since then is pending
   std::vector<F> v;
 
   FM_weight() = default;
@@ -47,169 +55,492 @@ class FM : public Base
   F v_l2;
 
   libcuckoo::cuckoohash_map<uint32_t, FM_weight> weights;
+  HotStore                                       hot; // rows are [w, v]
   F                                              bias = 0;
 
-  std::default_random_engine  rand_generator;
-  std::normal_distribution<F> gauss_distribution;
+  double w_log_keep;
+  double v_log_keep;
+
+  F        init_stddev;
+  uint64_t seed;
+
+  void init_row(uint32_t idx, FM_weight& weight);
+
+  FM_weight& scratch();
+
+  void catch_up(F& w, F* v, uint32_t& row_step, uint32_t now) const;
+
+  void catch_up(FM_weight& weight, uint32_t now) const;
+
+  // lookups and writes of rows of either tier, fn of update_fn is called with (w, v, step)
+  bool find(uint32_t idx, FM_weight& weight, uint32_t now, bool create);
+
+  template <typename Fn>
+  void update_fn(uint32_t idx, Fn fn);
+
+  void put(uint32_t idx, const FM_weight& weight);
+
+  void fill_hot();
+
+  // Rows of the (sample, feature) pairs of a batch, pair q at rows[q * (1 + n)] as [w, v] with n =
+  // N aligned to 8, unless the row is missing. sums holds sum of v * x of each sample, n floats.
+  struct Batch
+  {
+    std::vector<long>    hot_pos;
+    std::vector<uint8_t> found;
+    std::vector<F>       rows;
+    std::vector<F>       sums;
+    std::vector<F>       squares;
+  };
+
+  bool gather(uint32_t idx, long pos, F* row, uint32_t now, bool training);
+
+  void forward(const std::unique_ptr<Sample>* samples, size_t n_samples, Batch& b, F* preds,
+               bool training);
+
+  F accumulate(const std::vector<std::unique_ptr<Sample>>& sample_batch,
+               std::unordered_map<uint32_t, FM_weight>&   grad_map);
+
+  void update(uint32_t idx, F w_grad, const F* v_grad, uint32_t now);
 
  public:
   FM(size_t N, F w_lr, F v_lr, F w_l2, F v_l2, F init_stddev, long seed);
 
   void learn(const std::vector<std::unique_ptr<Sample>>& sample_batch) override;
 
-  F predict_prob(const std::unique_ptr<Sample>& sample, bool training);
+  void compute_grad(const std::vector<std::unique_ptr<Sample>>& sample_batch,
+                    GradBuffer&                                grad) override;
+
+  void apply_grad(const GradBuffer& grad, size_t bucket) override;
+
+  void set_hot_rows(const std::vector<uint32_t>& ids) override;
+
+  void set_dense_rows(size_t n) override;
 
   F predict_prob(const std::unique_ptr<Sample>& sample) override;
 
+  void predict_batch(const std::vector<std::unique_ptr<Sample>>& samples,
+                     std::vector<F>&                          preds) override;
+
   void sgd(const F& bias_grad, const std::unordered_map<uint32_t, FM_weight>& grad_map);
 
   size_t load(const std::string& fname) override;
 
   int save(const std::string& fname) override;
+
+  MemInfo mem_info() override;
+
+  size_t evict(size_t n) override;
+
+  size_t row_dim() override;
+
+  bool get_row(uint32_t idx, F* row, bool create) override;
+
+  void set_row(uint32_t idx, const F* row) override;
+
+  void add_row(uint32_t idx, const F* delta) override;
+
+  void clear() override;
 };
 
-FM::FM(size_t N, F w_lr, F v_lr, F w_l2, F v_l2, F init_stddev, long seed)
-: N(N), w_lr(w_lr), v_lr(v_lr), w_l2(w_l2), v_l2(v_l2)
+inline FM::FM(size_t N, F w_lr, F v_lr, F w_l2, F v_l2, F init_stddev, long seed)
+: N(N), w_lr(w_lr), v_lr(v_lr), w_l2(w_l2), v_l2(v_l2), w_log_keep(l2_log_keep(w_lr, w_l2)),
+  v_log_keep(l2_log_keep(v_lr, v_l2)), init_stddev(init_stddev)
 {
-  if (seed != -1)
-    rand_generator = std::default_random_engine(seed);
-  gauss_distribution = std::normal_distribution<F>(0, init_stddev);
+  this->seed = seed != -1 ? (uint64_t)seed : std::random_device()();
 }
 
-void FM::sgd(const F& bias_grad, const std::unordered_map<uint32_t, FM_weight>& grad_map)
+// a function of (seed, idx), so it does not depend on which thread inserts the row first
+inline void FM::init_row(uint32_t idx, FM_weight& weight)
 {
-  static thread_local FM_weight weight(N);
+  weight.w    = 0;
+  weight.step = step;
+  for (size_t k = 0; k < N; k++)
+    weight.v[k] = init_stddev * (F)hash_gauss(seed, idx, k);
+}
 
-  for (auto& [idx, val] : grad_map)
+// Row buffer of the calling thread. It is reset when the thread turns to another FM, e.g. models
+// trained together or scorers of different k, as init_row leaves the padding of v as it finds it.
+inline FM_weight& FM::scratch()
+{
+  static thread_local FM_weight weight;
+  static thread_local const FM* owner = nullptr;
+  if (owner != this)
+  {
+    weight.init(N);
+    owner = this;
+  }
+  return weight;
+}
+
+// applies l2 decay pending since the last update of row [w, v]
+inline void FM::catch_up(F& w, F* v, uint32_t& row_step, uint32_t now) const
+{
+  uint32_t steps = pending_steps(now, row_step);
+  if (steps == 0)
+    return;
+  F dv = l2_decay(v_log_keep, steps);
+  w *= l2_decay(w_log_keep, steps);
+  row_step = now;
+  if (dv != 1)
+    for (size_t j = 0; j < N; j++)
+      v[j] *= dv;
+}
+
+inline void FM::catch_up(FM_weight& weight, uint32_t now) const
+{
+  catch_up(weight.w, weight.v.data(), weight.step, now);
+}
+
+// a fresh row of hot tier is missing unless create, then it is seen from now on, as a row inserted
+// into the hash table now
+inline bool FM::find(uint32_t idx, FM_weight& weight, uint32_t now, bool create)
+{
+  long pos = hot.find(idx);
+  if (pos >= 0)
+  {
+    bool found = true;
+    hot.with_row(pos, [&](F* row, uint32_t& row_step) {
+      if (hot.fresh(pos))
+      {
+        if (!(found = create))
+          return;
+        hot.set_fresh(pos, false);
+        row_step = now;
+      }
+      weight.w    = row[0];
+      weight.step = row_step;
+      std::copy(row + 1, row + 1 + weight.v.size(), weight.v.begin());
+    });
+    if (!found)
+      return false;
+  }
+  else if (!weights.find(idx, weight))
+    return false;
+  catch_up(weight, now);
+  return true;
+}
+
+template <typename Fn>
+inline void FM::update_fn(uint32_t idx, Fn fn)
+{
+  long pos = hot.find(idx);
+  if (pos >= 0)
+    hot.with_row(pos, [this, pos, &fn](F* row, uint32_t& row_step) {
+      if (!hot.fresh(pos))
+        fn(row[0], row + 1, row_step);
+    });
+  else
+    weights.update_fn(idx,
+                      [&fn](FM_weight& weight) { fn(weight.w, weight.v.data(), weight.step); });
+}
+
+inline void FM::put(uint32_t idx, const FM_weight& weight)
+{
+  long pos = hot.find(idx);
+  if (pos < 0)
   {
-    weights.find(idx, weight);
-    weight.w += (w_lr * val.w);
+    weights.insert_or_assign(idx, weight);
+    return;
+  }
+  hot.with_row(pos, [this, pos, &weight](F* row, uint32_t& row_step) {
+    row[0]   = weight.w;
+    row_step = weight.step;
+    std::copy(weight.v.begin(), weight.v.end(), row + 1);
+    hot.set_fresh(pos, false);
+  });
+}
+
+inline void FM::update(uint32_t idx, F w_grad, const F* v_grad, uint32_t now)
+{
+  // refused or evicted by memory budget if missing
+  update_fn(idx, [this, w_grad, v_grad, now](F& w, F* v, uint32_t& row_step) {
+    catch_up(w, v, row_step, now);
+    w += (w_lr * w_grad);
     for (size_t j = 0; j < N; j += 8)
     {
-      __m256 v = _mm256_loadu_ps(weight.v.data() + j);
-      __m256 g = _mm256_loadu_ps(val.v.data() + j);
-      v        = _mm256_add_ps(v, _mm256_mul_ps(_mm256_set1_ps(v_lr), g));
-      _mm256_storeu_ps(weight.v.data() + j, v);
+      __m256 vj = _mm256_loadu_ps(v + j);
+      __m256 g  = _mm256_loadu_ps(v_grad + j);
+      vj        = _mm256_add_ps(vj, _mm256_mul_ps(_mm256_set1_ps(v_lr), g));
+      _mm256_storeu_ps(v + j, vj);
     }
-    weights.insert_or_assign(idx, weight);
+  });
+}
+
+inline void FM::set_hot_rows(const std::vector<uint32_t>& ids)
+{
+  hot.build(ids, 1 + FM_weight(N).v.size());
+  fill_hot();
+}
+
+inline void FM::set_dense_rows(size_t n)
+{
+  hot.build_dense(n, 1 + FM_weight(N).v.size());
+  fill_hot();
+}
+
+// Moves rows of ids of hot tier from the hash table, the others are initialized and left fresh, so
+// they are stamped when first seen and training does not depend on which rows are hot.
+inline void FM::fill_hot()
+{
+  FM_weight weight(N);
+  for (size_t pos = 0; pos < hot.size(); pos++)
+  {
+    bool found = weights.find(hot.id(pos), weight);
+    if (found)
+      weights.erase(hot.id(pos));
+    else
+      init_row(hot.id(pos), weight);
+    put(hot.id(pos), weight);
+    hot.set_fresh(pos, !found);
   }
+}
+
+inline void FM::sgd(const F& bias_grad, const std::unordered_map<uint32_t, FM_weight>& grad_map)
+{
+  TraceSpan span("sgd");
+  uint32_t  now = ++step;
+  for (auto& [idx, val] : grad_map)
+    update(idx, val.w, val.v.data(), now);
+  Stats::add(Stats::LOOKUPS, grad_map.size());
+  Stats::add(Stats::UPDATES, grad_map.size());
 
   bias += (w_lr * bias_grad);
 }
 
-void FM::learn(const std::vector<std::unique_ptr<Sample>>& sample_batch)
+inline void FM::learn(const std::vector<std::unique_ptr<Sample>>& sample_batch)
 {
   static thread_local std::unordered_map<uint32_t, FM_weight> grad_map;
-  static thread_local FM_weight                               weight(N);
 
-  auto       size = (float)sample_batch.size();
-  FM_weight* grad;
-  F          bias_grad = 0;
-  for (auto& sample : sample_batch)
+  F bias_grad = accumulate(sample_batch, grad_map);
+  sgd(bias_grad, grad_map);
+  grad_map.clear();
+}
+
+// rows are [w, v_0, ..., v_{n-1}] with n = N aligned to 8
+inline void FM::compute_grad(const std::vector<std::unique_ptr<Sample>>& sample_batch,
+                               GradBuffer&                                grad)
+{
+  static thread_local std::unordered_map<uint32_t, FM_weight> grad_map;
+
+  size_t n  = ((N - 1) / 8 + 1) * 8;
+  grad.dim  = 1 + n;
+  grad.bias = accumulate(sample_batch, grad_map);
+  grad.ids.clear();
+  grad.rows.clear();
+  for (auto& [idx, val] : grad_map)
   {
-    uint32_t& y = sample->y;
-    F         p = predict_prob(sample, true);
-    F         t = (float)y - p;
-    bias_grad += (t / size);
+    grad.ids.push_back(idx);
+    grad.rows.push_back(val.w);
+    grad.rows.insert(grad.rows.end(), val.v.begin(), val.v.begin() + n);
+  }
+  grad.group();
+  grad_map.clear();
+}
 
-    for (size_t j = 0; j < N; j += 8)
+inline void FM::apply_grad(const GradBuffer& grad, size_t bucket)
+{
+  uint32_t now = step + grad.seq + 1;
+  for (uint32_t k = grad.bucket_begin[bucket]; k < grad.bucket_begin[bucket + 1]; k++)
+  {
+    const F* row = grad.rows.data() + k * grad.dim;
+    update(grad.ids[k], row[0], row + 1, now);
+  }
+  Stats::add(Stats::UPDATES, grad.bucket_begin[bucket + 1] - grad.bucket_begin[bucket]);
+  if (bucket == 0)
+    bias += (w_lr * grad.bias);
+}
+
+// Copies the row of idx to row, pos is its position in hot tier or -1, false if it is missing and
+// not inserted. Rows are inserted if training unless memory budget is reached.
+inline bool FM::gather(uint32_t idx, long pos, F* row, uint32_t now, bool training)
+{
+  size_t   dim = 1 + ((N - 1) / 8 + 1) * 8;
+  uint32_t row_step;
+  if (pos >= 0)
+  {
+    bool found = true;
+    hot.with_row(pos, [&](F* r, uint32_t& r_step) {
+      if (hot.fresh(pos))
+      {
+        if (!(found = training))
+          return;
+        hot.set_fresh(pos, false);
+        r_step = now;
+        Stats::add(Stats::NEW_FEATS, 1);
+      }
+      std::copy(r, r + dim, row);
+      row_step = r_step;
+    });
+    if (!found)
+      return false;
+  }
+  else if (!weights.find_fn(idx, [row, &row_step](const FM_weight& weight) {
+             row[0] = weight.w;
+             std::copy(weight.v.begin(), weight.v.end(), row + 1);
+             row_step = weight.step;
+           }))
+  {
+    if (!training || !accept_new_row())
+      return false;
+    FM_weight& weight = scratch();
+    init_row(idx, weight);
+    if (weights.insert(idx, weight))
+      Stats::add(Stats::NEW_FEATS, 1);
+    else
+      Stats::add(Stats::INSERT_RACES, 1);
+    row[0] = weight.w;
+    std::copy(weight.v.begin(), weight.v.end(), row + 1);
+    row_step = weight.step;
+  }
+  catch_up(row[0], row + 1, row_step, now);
+  return true;
+}
+
+// Scores samples at once. Rows of all pairs are looked up first, rows of hot tier prefetched as
+// their positions are found, and copied once each, then each sample takes a single pass over its
+// features for all N dims.
+inline void FM::forward(const std::unique_ptr<Sample>* samples, size_t n_samples, Batch& b,
+                        F* preds, bool training)
+{
+  size_t   n       = ((N - 1) / 8 + 1) * 8;
+  size_t   dim     = 1 + n;
+  uint32_t now     = step;
+  size_t   n_pairs = 0;
+  for (size_t s = 0; s < n_samples; s++)
+    n_pairs += samples[s]->x->size();
+  b.hot_pos.resize(n_pairs);
+  b.found.resize(n_pairs);
+  b.rows.resize(n_pairs * dim);
+  b.sums.resize(n_samples * n);
+  b.squares.resize(n);
+
+  size_t q = 0;
+  for (size_t s = 0; s < n_samples; s++)
+  {
+    for (auto& [i, xi] : *samples[s]->x)
     {
-      __m256 sum_of_vx = _mm256_set1_ps(0);
-      for (auto& [i, xi] : *(sample->x))
+      long pos       = hot.find(i);
+      b.hot_pos[q++] = pos;
+      if (pos >= 0)
+        hot.prefetch(pos);
+    }
+  }
+  q = 0;
+  for (size_t s = 0; s < n_samples; s++)
+  {
+    for (auto& [i, xi] : *samples[s]->x)
+    {
+      b.found[q] = gather(i, b.hot_pos[q], b.rows.data() + q * dim, now, training);
+      q++;
+    }
+  }
+  Stats::add(Stats::LOOKUPS, n_pairs);
+
+  q = 0;
+  for (size_t s = 0; s < n_samples; s++)
+  {
+    F  p   = bias;
+    F* sum = b.sums.data() + s * n;
+    F* sq  = b.squares.data();
+    std::fill(sum, sum + n, 0);
+    std::fill(sq, sq + n, 0);
+    for (auto& [i, xi] : *samples[s]->x)
+    {
+      const F* row = b.rows.data() + q * dim;
+      if (!b.found[q++])
+        continue;
+      p += (row[0] * xi);
+      __m256 x = _mm256_set1_ps(xi);
+      for (size_t j = 0; j < n; j += 8)
       {
-        weights.find(i, weight);
-        __m256 v  = _mm256_loadu_ps(weight.v.data() + j);
-        __m256 x  = _mm256_set1_ps(xi);
-        v         = _mm256_mul_ps(v, x);
-        sum_of_vx = _mm256_add_ps(sum_of_vx, v);
+        __m256 v = _mm256_mul_ps(_mm256_loadu_ps(row + 1 + j), x);
+        _mm256_storeu_ps(sum + j, _mm256_add_ps(_mm256_loadu_ps(sum + j), v));
+        _mm256_storeu_ps(sq + j, _mm256_add_ps(_mm256_loadu_ps(sq + j), _mm256_mul_ps(v, v)));
       }
-      for (auto& [i, xi] : *(sample->x))
+    }
+    __m256 res = _mm256_set1_ps(0);
+    for (size_t j = 0; j < n; j += 8)
+    {
+      __m256 sj = _mm256_loadu_ps(sum + j);
+      res       = _mm256_add_ps(res, _mm256_sub_ps(_mm256_mul_ps(sj, sj), _mm256_loadu_ps(sq + j)));
+    }
+    alignas(32) F lanes[8];
+    _mm256_store_ps(lanes, res);
+    for (size_t j = 0; j < 8; j++)
+    {
+      p += (0.5f * lanes[j]);
+    }
+    preds[s] = sigmoid(p);
+  }
+}
+
+// adds gradients of samples to grad_map, returns gradient of bias, l2 is left to update
+inline F FM::accumulate(const std::vector<std::unique_ptr<Sample>>& sample_batch,
+                        std::unordered_map<uint32_t, FM_weight>&   grad_map)
+{
+  static thread_local Batch          b;
+  static thread_local std::vector<F> preds;
+
+  size_t n         = ((N - 1) / 8 + 1) * 8;
+  size_t dim       = 1 + n;
+  auto   size      = (float)sample_batch.size();
+  F      bias_grad = 0;
+  preds.resize(sample_batch.size());
+  forward(sample_batch.data(), sample_batch.size(), b, preds.data(), true);
+
+  size_t q = 0;
+  for (size_t s = 0; s < sample_batch.size(); s++)
+  {
+    F        t   = (float)sample_batch[s]->y - preds[s];
+    const F* sum = b.sums.data() + s * n;
+    bias_grad += (t / size);
+    for (auto& [i, xi] : *sample_batch[s]->x)
+    {
+      const F* row = b.rows.data() + q * dim;
+      if (!b.found[q++])
+        continue;
+      auto [it, inserted] = grad_map.try_emplace(i);
+      FM_weight* grad     = &it->second;
+      if (inserted)
+        grad->init(N); // if i not in grad_map, make a zero grad
+      grad->w += (t * xi) / size;
+      for (size_t j = 0; j < n; j += 8)
       {
-        weights.find(i, weight);
-        if (grad_map.find(i) == grad_map.end())
-        {
-          grad = &grad_map[i];
-          grad->init(N); // if i not in grad_map, make a zero grad
-        }
-        else
-        {
-          grad = &grad_map[i];
-        }
-        if (j == 0) [[unlikely]] // linear part
-        {
-          grad->w += (t * xi - w_l2 * weight.w) / size;
-        }
         __m256 x   = _mm256_set1_ps(xi);
-        __m256 tmp = _mm256_mul_ps(sum_of_vx, x);
-        __m256 v   = _mm256_loadu_ps(weight.v.data() + j);
+        __m256 tmp = _mm256_mul_ps(_mm256_loadu_ps(sum + j), x);
+        __m256 v   = _mm256_loadu_ps(row + 1 + j);
         x          = _mm256_mul_ps(x, x);
         x          = _mm256_mul_ps(x, v);
         x          = _mm256_sub_ps(tmp, x);
         x          = _mm256_mul_ps(x, _mm256_set1_ps(t));
-        x          = _mm256_sub_ps(x, _mm256_mul_ps(_mm256_set1_ps(v_l2), v));
         __m256 g   = _mm256_loadu_ps(grad->v.data() + j);
         g          = _mm256_add_ps(g, _mm256_div_ps(x, _mm256_set1_ps(size)));
         _mm256_storeu_ps(grad->v.data() + j, g);
       }
     }
   }
-
-  sgd(bias_grad, grad_map);
-  grad_map.clear();
+  return bias_grad;
 }
 
-F FM::predict_prob(const std::unique_ptr<Sample>& sample)
+inline F FM::predict_prob(const std::unique_ptr<Sample>& sample)
 {
-  return predict_prob(sample, false);
+  static thread_local Batch b;
+
+  F p;
+  forward(&sample, 1, b, &p, false);
+  return calibrate(p);
 }
 
-F FM::predict_prob(const std::unique_ptr<Sample>& sample, bool training)
+inline void FM::predict_batch(const std::vector<std::unique_ptr<Sample>>& samples,
+                              std::vector<F>&                          preds)
 {
-  static thread_local FM_weight weight(N);
-  F                             p = bias;
-  for (auto& [i, xi] : *(sample->x))
-  {
-    if (!weights.find(i, weight))
-    {
-      if (training)
-      {
-        weight.w = 0;
-        for (size_t k = 0; k < N; k++)
-          weight.v[k] = gauss_distribution(rand_generator);
-        weights.insert(i, weight);
-      }
-      else
-      {
-        continue;
-      }
-    }
-    p += (weight.w * xi);
-  }
+  static thread_local Batch b;
 
-  __m256 res = _mm256_set1_ps(0);
-  for (size_t j = 0; j < N; j += 8)
-  {
-    __m256 sum = _mm256_set1_ps(0), sum_of_square = _mm256_set1_ps(0);
-    for (auto& [i, xi] : *(sample->x))
-    {
-      if (!weights.find(i, weight))
-        continue;
-      __m256 v      = _mm256_loadu_ps(weight.v.data() + j);
-      __m256 x      = _mm256_set1_ps(xi);
-      v             = _mm256_mul_ps(v, x);
-      sum           = _mm256_add_ps(sum, v);
-      sum_of_square = _mm256_add_ps(sum_of_square, _mm256_mul_ps(v, v));
-    }
-    sum = _mm256_sub_ps(_mm256_mul_ps(sum, sum), sum_of_square);
-    res = _mm256_add_ps(res, sum);
-  }
-  _mm256_storeu_ps(weight.v.data(), res);
-  for (size_t j = 0; j < 8; j++)
-  {
-    p += (0.5f * weight.v[j]);
-  }
-  p = sigmoid(p);
-  return p;
+  preds.resize(samples.size());
+  forward(samples.data(), samples.size(), b, preds.data(), false);
+  for (F& p : preds)
+    p = calibrate(p);
 }
 
 #define check_line(line, tokens, n)                                                                \
@@ -241,7 +572,7 @@ inline bool next_tokens(std::ifstream& ifs, std::string& line, std::vector<std::
   string_split(line, tokens, "\t");
   return true;
 }
-size_t FM::load(const std::string& fname)
+inline size_t FM::load(const std::string& fname)
 {
   std::ifstream::sync_with_stdio(false);
   std::ifstream ifs;
@@ -252,6 +583,8 @@ size_t FM::load(const std::string& fname)
   char*                         endptr;
   fast_float::from_chars_result answer{};
 
+  if (!load_neg_rate(ifs))
+    return 0;
   next_tokens(ifs, line, tokens);
   check_line(line, tokens, 2);
   if (tokens[0] != "k")
@@ -259,7 +592,15 @@ size_t FM::load(const std::string& fname)
     spdlog::error("model parse error. @k");
     return 0;
   }
-  parse_idx(line, tokens[1].c_str(), N);
+  size_t k;
+  parse_idx(line, tokens[1].c_str(), k);
+  // rows of the hot tier are already sized by N
+  if (hot.size() > 0 && k != N)
+  {
+    spdlog::error("model k {} does not match factor {} of hot rows", k, N);
+    return 0;
+  }
+  N = k;
 
   next_tokens(ifs, line, tokens);
   check_line(line, tokens, 2);
@@ -273,6 +614,7 @@ size_t FM::load(const std::string& fname)
   FM_weight weight(N);
   uint32_t  idx;
   F         val;
+  weight.step = step;
   while (next_tokens(ifs, line, tokens))
   {
     check_line(line, tokens, N + 2);
@@ -287,32 +629,150 @@ size_t FM::load(const std::string& fname)
       parse_val(line, tokens[i + 2].c_str(), val);
       weight.v[i] = val;
     }
-    weights.insert(idx, weight);
+    put(idx, weight);
   }
   ifs.close();
-  return weights.size();
+  return weights.size() + hot.size();
 }
 
-int FM::save(const std::string& fname)
+inline int FM::save(const std::string& fname)
 {
   std::ofstream::sync_with_stdio(false);
   std::ofstream ofs;
   ofs.open(fname, std::ofstream::out);
+  save_neg_rate(ofs);
   ofs << "k\t" << N << std::endl;
   ofs << "bias\t" << bias << std::endl;
-  auto lt = weights.lock_table();
-  for (const auto& it : lt)
-  {
-    const FM_weight& weight = it.second;
-    ofs << it.first << "\t" << weight.w;
+  FM_weight weight(N);
+  uint32_t  now   = step;
+  auto      write = [this, &ofs, &weight, now](uint32_t idx) {
+    catch_up(weight, now);
+    ofs << idx << "\t" << weight.w;
     for (size_t j = 0; j < N; ++j)
     {
       ofs << "\t" << weight.v[j];
     }
     ofs << std::endl;
+  };
+  auto lt = weights.lock_table();
+  for (const auto& it : lt)
+  {
+    weight = it.second;
+    write(it.first);
+  }
+  for (size_t pos = 0; pos < hot.size(); pos++)
+  {
+    if (hot.fresh(pos))
+      continue;
+    weight.w    = hot.row(pos)[0];
+    weight.step = hot.step(pos);
+    std::copy(hot.row(pos) + 1, hot.row(pos) + 1 + weight.v.size(), weight.v.begin());
+    write(hot.id(pos));
   }
   ofs.close();
   return 0;
 }
 
+inline MemInfo FM::mem_info()
+{
+  MemInfo info;
+  info.rows        = weights.size();
+  info.table_bytes = cuckoo_table_bytes(weights);
+  info.heap_bytes  = info.rows * malloc_bytes(((N - 1) / 8 + 1) * 8 * sizeof(F));
+  info.load_factor = weights.load_factor();
+  info.hot_rows    = hot.size();
+  info.hot_bytes   = hot.bytes();
+  return info;
+}
+
+inline size_t FM::evict(size_t n)
+{
+  FM_weight                           weight(N);
+  uint32_t                            now = step;
+  auto                                lt  = weights.lock_table();
+  std::vector<std::pair<F, uint32_t>> magnitudes;
+  magnitudes.reserve(lt.size());
+  for (const auto& it : lt)
+  {
+    weight = it.second;
+    catch_up(weight, now);
+    F m = weight.w * weight.w;
+    for (size_t j = 0; j < N; ++j)
+      m += weight.v[j] * weight.v[j];
+    magnitudes.emplace_back(m, it.first);
+  }
+  n = std::min(n, magnitudes.size());
+  std::nth_element(magnitudes.begin(), magnitudes.begin() + n, magnitudes.end());
+  for (size_t i = 0; i < n; i++)
+    lt.erase(magnitudes[i].second);
+  return n;
+}
+
+inline size_t FM::row_dim()
+{
+  return 1 + N;
+}
+
+inline bool FM::get_row(uint32_t idx, F* row, bool create)
+{
+  FM_weight& weight = scratch();
+
+  if (idx == BIAS_ROW)
+  {
+    row[0] = bias;
+    std::fill(row + 1, row + 1 + N, 0);
+    return true;
+  }
+  if (!find(idx, weight, step, create))
+  {
+    if (!create || !accept_new_row())
+      return false;
+    init_row(idx, weight);
+    if (!weights.insert(idx, weight))
+      find(idx, weight, step, false);
+  }
+  row[0] = weight.w;
+  std::copy(weight.v.begin(), weight.v.begin() + N, row + 1);
+  return true;
+}
+
+inline void FM::set_row(uint32_t idx, const F* row)
+{
+  FM_weight& weight = scratch();
+
+  if (idx == BIAS_ROW)
+  {
+    bias = row[0];
+    return;
+  }
+  weight.w    = row[0];
+  weight.step = step;
+  std::copy(row + 1, row + 1 + N, weight.v.begin());
+  put(idx, weight);
+}
+
+inline void FM::add_row(uint32_t idx, const F* delta)
+{
+  if (idx == BIAS_ROW)
+  {
+    bias += delta[0];
+    return;
+  }
+  uint32_t now = step;
+  update_fn(idx, [this, delta, now](F& w, F* v, uint32_t& row_step) {
+    catch_up(w, v, row_step, now);
+    w += delta[0];
+    for (size_t j = 0; j < N; j++)
+      v[j] += delta[j + 1];
+  });
+}
+
+inline void FM::clear()
+{
+  weights.clear();
+  bias = 0;
+  step = 0;
+  fill_hot();
+}
+
 #endif //FLATCTR_FM_MODEL_H
@@ -0,0 +1,153 @@
+#ifndef FLATCTR_HOT_STORE_H
+#define FLATCTR_HOT_STORE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <immintrin.h>
+#include <memory>
+#include <vector>
+
+#include "common.h"
+#include "flat_index.h"
+
+// Dense tier of the most frequent rows, e.g. ids present in nearly every sample, kept apart from
+// the hash table of the long tail so that they stay in cache. The set of ids is fixed by build, so
+// its index is never written afterwards and lookups take no lock. Each row is dim floats and a
+// step, guarded by a spinlock of its own on the same cache line. With build_dense, ids are already
+// dense (see Vocab) and index rows directly. A row may be marked fresh, i.e. initialized ahead of
+// training but not yet seen, which the model treats as missing from its hash table.
+class HotStore
+{
+ private:
+  // a row is a header followed by dim floats, padded to cache lines so hot rows share no line
+  struct Header
+  {
+    std::atomic<uint16_t> lock;
+    uint16_t              fresh;
+    uint32_t              step;
+  };
+
+  struct Free
+  {
+    void operator()(char* p) const
+    {
+      std::free(p);
+    }
+  };
+
+  FlatIndex                   index;
+  bool                        dense  = false;
+  size_t                      n_rows = 0;
+  size_t                      dim    = 0;
+  size_t                      stride = 0; // bytes per row
+  std::vector<uint32_t>       ids;
+  std::unique_ptr<char, Free> data;
+
+  Header& header(size_t pos)
+  {
+    return *(Header*)(data.get() + pos * stride);
+  }
+
+  void alloc(size_t n, size_t row_dim, size_t align)
+  {
+    n_rows = n;
+    dim    = row_dim;
+    stride = (sizeof(Header) + dim * sizeof(F) + align - 1) / align * align;
+    data.reset((char*)std::aligned_alloc(64, (std::max<size_t>(n * stride, 64) + 63) / 64 * 64));
+    reset();
+  }
+
+ public:
+  // ids must be unique, rows are zeroed
+  void build(const std::vector<uint32_t>& hot_ids, size_t row_dim)
+  {
+    dense = false;
+    ids   = hot_ids;
+    index.build(ids);
+    alloc(ids.size(), row_dim, 64);
+  }
+
+  // rows of ids 0, ..., n - 1, packed rather than padded to cache lines, as all rows are here
+  void build_dense(size_t n, size_t row_dim)
+  {
+    dense = true;
+    ids.clear();
+    index.build(ids);
+    alloc(n, row_dim, alignof(Header));
+  }
+
+  void reset()
+  {
+    if (data != nullptr)
+      memset(data.get(), 0, n_rows * stride);
+  }
+
+  // pos of row of id, -1 if id is not hot
+  [[nodiscard]] long find(uint32_t id) const
+  {
+    if (dense)
+      return id < n_rows ? (long)id : -1;
+    return index.find(id);
+  }
+
+  // calls fn(row, step) under the lock of row pos
+  template <typename Fn>
+  void with_row(size_t pos, Fn fn)
+  {
+    Header& h = header(pos);
+    while (h.lock.exchange(1, std::memory_order_acquire))
+      _mm_pause();
+    fn(row(pos), h.step);
+    h.lock.store(0, std::memory_order_release);
+  }
+
+  // brings row pos to cache ahead of with_row
+  void prefetch(size_t pos) const
+  {
+    const char* p = data.get() + pos * stride;
+    for (const char* q = p; q < p + stride; q += 64)
+      _mm_prefetch(q, _MM_HINT_T0);
+    _mm_prefetch(p + stride - 1, _MM_HINT_T0); // packed rows may straddle one more line
+  }
+
+  // unlocked access, for save and load while no thread trains
+  F* row(size_t pos)
+  {
+    return (F*)(data.get() + pos * stride + sizeof(Header));
+  }
+
+  uint32_t& step(size_t pos)
+  {
+    return header(pos).step;
+  }
+
+  // under the lock of row pos, or while no thread trains
+  [[nodiscard]] bool fresh(size_t pos)
+  {
+    return header(pos).fresh != 0;
+  }
+
+  void set_fresh(size_t pos, bool fresh)
+  {
+    header(pos).fresh = fresh;
+  }
+
+  [[nodiscard]] uint32_t id(size_t pos) const
+  {
+    return dense ? (uint32_t)pos : ids[pos];
+  }
+
+  [[nodiscard]] size_t size() const
+  {
+    return n_rows;
+  }
+
+  [[nodiscard]] size_t bytes() const
+  {
+    return index.bytes() + ids.size() * sizeof(uint32_t) + n_rows * stride;
+  }
+};
+
+#endif //FLATCTR_HOT_STORE_H
@@ -2,6 +2,7 @@
 #define FLATCTR_LR_MODEL_H
 
 #include <cstdlib>
+#include <fstream>
 #include <memory>
 #include <unordered_map>
 
@@ -10,22 +11,105 @@
 #include "base_model.h"
 #include "common.h"
 #include "dataset/sample.h"
+#include "hot_store.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
+struct LR_weight
+{
+  F        w    = 0;
+  uint32_t step = 0; // of last update, l2 decay since then is pending
+};
+
 class LR : public Base
 {
  private:
-  F lr;
-  F l2;
+  F      lr;
+  F      l2;
+  double log_keep;
 
-  libcuckoo::cuckoohash_map<uint32_t, F> weights;
-  F                                      bias = 0;
+  libcuckoo::cuckoohash_map<uint32_t, LR_weight> weights;
+  HotStore                                       hot;
+  F                                              bias = 0;
+
+  [[nodiscard]] F value(const LR_weight& weight, uint32_t now) const
+  {
+    return weight.w * l2_decay(log_keep, pending_steps(now, weight.step));
+  }
+
+  // lookups and writes of rows of either tier
+  bool find(uint32_t idx, LR_weight& weight)
+  {
+    long pos = hot.find(idx);
+    if (pos < 0)
+      return weights.find(idx, weight);
+    hot.with_row(pos, [&weight](F* row, uint32_t& step) { weight = LR_weight{row[0], step}; });
+    return true;
+  }
+
+  template <typename Fn>
+  void update_fn(uint32_t idx, Fn fn)
+  {
+    long pos = hot.find(idx);
+    if (pos < 0)
+    {
+      weights.update_fn(idx, fn);
+      return;
+    }
+    hot.with_row(pos, [&fn](F* row, uint32_t& step) {
+      LR_weight weight{row[0], step};
+      fn(weight);
+      row[0] = weight.w;
+      step   = weight.step;
+    });
+  }
+
+  // moves rows of ids of hot tier from the hash table, the others start at 0
+  void fill_hot()
+  {
+    LR_weight weight;
+    for (size_t pos = 0; pos < hot.size(); pos++)
+    {
+      if (!weights.find(hot.id(pos), weight))
+        continue;
+      hot.row(pos)[0] = weight.w;
+      hot.step(pos)   = weight.step;
+      weights.erase(hot.id(pos));
+    }
+  }
+
+  void put(uint32_t idx, const LR_weight& weight)
+  {
+    long pos = hot.find(idx);
+    if (pos < 0)
+      weights.insert_or_assign(idx, weight);
+    else
+      hot.with_row(pos, [&weight](F* row, uint32_t& step) {
+        row[0] = weight.w;
+        step   = weight.step;
+      });
+  }
+
+  F accumulate(const std::vector<std::unique_ptr<Sample>>& sample_batch,
+               std::unordered_map<uint32_t, F>&           grad_map);
+
+  void update(uint32_t idx, F grad, uint32_t now);
 
  public:
   LR(F lr, F l2);
 
   void learn(const std::vector<std::unique_ptr<Sample>>& sample_batch) override;
 
+  void compute_grad(const std::vector<std::unique_ptr<Sample>>& sample_batch,
+                    GradBuffer&                                grad) override;
+
+  void apply_grad(const GradBuffer& grad, size_t bucket) override;
+
+  void set_hot_rows(const std::vector<uint32_t>& ids) override;
+
+  void set_dense_rows(size_t n) override;
+
   F predict_prob(const std::unique_ptr<Sample>& sample, bool training);
 
   F predict_prob(const std::unique_ptr<Sample>& sample) override;
@@ -35,28 +119,98 @@ class LR : public Base
   size_t load(const std::string& fname) override;
 
   int save(const std::string& fname) override;
+
+  MemInfo mem_info() override;
+
+  size_t evict(size_t n) override;
+
+  size_t row_dim() override;
+
+  bool get_row(uint32_t idx, F* row, bool create) override;
+
+  void set_row(uint32_t idx, const F* row) override;
+
+  void add_row(uint32_t idx, const F* delta) override;
+
+  void clear() override;
 };
 
-LR::LR(F lr, F l2) : lr(lr), l2(l2) {}
+inline LR::LR(F lr, F l2) : lr(lr), l2(l2), log_keep(l2_log_keep(lr, l2)) {}
+
+inline void LR::update(uint32_t idx, F grad, uint32_t now)
+{
+  // refused or evicted by memory budget if missing
+  update_fn(idx, [this, grad, now](LR_weight& weight) {
+    weight.w    = value(weight, now) + lr * grad;
+    weight.step = later_step(now, weight.step);
+  });
+}
 
-void LR::sgd(const F& bias_grad, const std::unordered_map<uint32_t, F>& grad_map)
+inline void LR::sgd(const F& bias_grad, const std::unordered_map<uint32_t, F>& grad_map)
 {
-  F w = 0;
+  TraceSpan span("sgd");
+  uint32_t  now = ++step;
   for (auto& [idx, val] : grad_map)
-  {
-    weights.find(idx, w);
-    w += (lr * val);
-    weights.insert_or_assign(idx, w);
-  }
+    update(idx, val, now);
+  Stats::add(Stats::LOOKUPS, grad_map.size());
+  Stats::add(Stats::UPDATES, grad_map.size());
 
   bias += (lr * bias_grad);
 }
 
-void LR::learn(const std::vector<std::unique_ptr<Sample>>& sample_batch)
+inline void LR::learn(const std::vector<std::unique_ptr<Sample>>& sample_batch)
+{
+  static thread_local std::unordered_map<uint32_t, F> grad_map;
+
+  F bias_grad = accumulate(sample_batch, grad_map);
+  sgd(bias_grad, grad_map);
+  grad_map.clear();
+}
+
+inline void LR::compute_grad(const std::vector<std::unique_ptr<Sample>>& sample_batch,
+                               GradBuffer&                                grad)
 {
   static thread_local std::unordered_map<uint32_t, F> grad_map;
-  F w = 0;
 
+  grad.dim  = 1;
+  grad.bias = accumulate(sample_batch, grad_map);
+  grad.ids.clear();
+  grad.rows.clear();
+  for (auto& [idx, val] : grad_map)
+  {
+    grad.ids.push_back(idx);
+    grad.rows.push_back(val);
+  }
+  grad.group();
+  grad_map.clear();
+}
+
+inline void LR::apply_grad(const GradBuffer& grad, size_t bucket)
+{
+  uint32_t now = step + grad.seq + 1;
+  for (uint32_t k = grad.bucket_begin[bucket]; k < grad.bucket_begin[bucket + 1]; k++)
+    update(grad.ids[k], grad.rows[k], now);
+  Stats::add(Stats::UPDATES, grad.bucket_begin[bucket + 1] - grad.bucket_begin[bucket]);
+  if (bucket == 0)
+    bias += (lr * grad.bias);
+}
+
+inline void LR::set_hot_rows(const std::vector<uint32_t>& ids)
+{
+  hot.build(ids, 1);
+  fill_hot();
+}
+
+inline void LR::set_dense_rows(size_t n)
+{
+  hot.build_dense(n, 1);
+  fill_hot();
+}
+
+// adds gradients of samples to grad_map, returns gradient of bias, l2 is left to update
+inline F LR::accumulate(const std::vector<std::unique_ptr<Sample>>& sample_batch,
+                        std::unordered_map<uint32_t, F>&           grad_map)
+{
   auto size      = (float)sample_batch.size();
   F    bias_grad = 0;
   for (auto& sample : sample_batch)
@@ -66,46 +220,53 @@ void LR::learn(const std::vector<std::unique_ptr<Sample>>& sample_batch)
     F         t = (float)y - p;
     for (auto& [i, xi] : *(sample->x))
     {
-      weights.find(i, w);
       if (grad_map.find(i) == grad_map.end())
         grad_map[i] = 0;
-      grad_map[i] += (t * xi - l2 * w) / size;
+      grad_map[i] += (t * xi) / size;
     }
     bias_grad += t / size;
   }
-
-  sgd(bias_grad, grad_map);
-  grad_map.clear();
+  return bias_grad;
 }
 
-F LR::predict_prob(const std::unique_ptr<Sample>& sample)
+inline F LR::predict_prob(const std::unique_ptr<Sample>& sample)
 {
-  return predict_prob(sample, false);
+  return calibrate(predict_prob(sample, false));
 }
 
-F LR::predict_prob(const std::unique_ptr<Sample>& sample, bool training)
+inline F LR::predict_prob(const std::unique_ptr<Sample>& sample, bool training)
 {
-  F p = bias, w;
+  F         p   = bias;
+  uint32_t  now = step;
+  LR_weight weight;
   for (auto& [i, xi] : *(sample->x))
   {
-    if (!weights.find(i, w))
+    if (!find(i, weight))
     {
-      if (training)
-        weights.insert_or_assign(i, 0);
+      if (training && accept_new_row())
+      {
+        if (weights.insert(i, LR_weight{0, now}))
+          Stats::add(Stats::NEW_FEATS, 1);
+        else
+          Stats::add(Stats::INSERT_RACES, 1);
+      }
       continue;
     }
-    p += (w * xi);
+    p += (value(weight, now) * xi);
   }
+  Stats::add(Stats::LOOKUPS, sample->x->size());
   p = sigmoid(p);
   return p;
 }
 
-size_t LR::load(const std::string& fname)
+inline size_t LR::load(const std::string& fname)
 {
   std::ifstream::sync_with_stdio(false);
   std::ifstream ifs;
   ifs.open(fname, std::ifstream::in);
   std::string tmp;
+  if (!load_neg_rate(ifs))
+    return 0;
   ifs >> tmp >> bias;
   if (tmp != "bias")
   {
@@ -117,23 +278,112 @@ size_t LR::load(const std::string& fname)
   while (!ifs.eof())
   {
     ifs >> idx >> val;
-    weights.insert(idx, val);
+    put(idx, LR_weight{val, step});
   }
   ifs.close();
-  return weights.size();
+  return weights.size() + hot.size();
 }
 
-int LR::save(const std::string& fname)
+inline int LR::save(const std::string& fname)
 {
   std::ofstream::sync_with_stdio(false);
   std::ofstream ofs;
   ofs.open(fname, std::ofstream::out);
+  save_neg_rate(ofs);
   ofs << "bias\t" << bias << std::endl;
-  auto lt = weights.lock_table();
+  uint32_t now = step;
+  auto     lt  = weights.lock_table();
   for (const auto& it : lt)
-    ofs << it.first << "\t" << it.second << std::endl;
+    ofs << it.first << "\t" << value(it.second, now) << std::endl;
+  for (size_t pos = 0; pos < hot.size(); pos++)
+  {
+    LR_weight weight{hot.row(pos)[0], hot.step(pos)};
+    ofs << hot.id(pos) << "\t" << value(weight, now) << std::endl;
+  }
   ofs.close();
   return 0;
 }
 
+inline MemInfo LR::mem_info()
+{
+  MemInfo info;
+  info.rows        = weights.size();
+  info.table_bytes = cuckoo_table_bytes(weights);
+  info.load_factor = weights.load_factor();
+  info.hot_rows    = hot.size();
+  info.hot_bytes   = hot.bytes();
+  return info;
+}
+
+inline size_t LR::evict(size_t n)
+{
+  uint32_t                            now = step;
+  auto                                lt  = weights.lock_table();
+  std::vector<std::pair<F, uint32_t>> magnitudes;
+  magnitudes.reserve(lt.size());
+  for (const auto& it : lt)
+    magnitudes.emplace_back(std::fabs(value(it.second, now)), it.first);
+  n = std::min(n, magnitudes.size());
+  std::nth_element(magnitudes.begin(), magnitudes.begin() + n, magnitudes.end());
+  for (size_t i = 0; i < n; i++)
+    lt.erase(magnitudes[i].second);
+  return n;
+}
+
+inline size_t LR::row_dim()
+{
+  return 1;
+}
+
+inline bool LR::get_row(uint32_t idx, F* row, bool create)
+{
+  if (idx == BIAS_ROW)
+  {
+    row[0] = bias;
+    return true;
+  }
+  uint32_t  now = step;
+  LR_weight weight;
+  if (!find(idx, weight))
+  {
+    if (!create || !accept_new_row())
+      return false;
+    weight = LR_weight{0, now};
+    if (!weights.insert(idx, weight))
+      weights.find(idx, weight);
+  }
+  row[0] = value(weight, now);
+  return true;
+}
+
+inline void LR::set_row(uint32_t idx, const F* row)
+{
+  if (idx == BIAS_ROW)
+    bias = row[0];
+  else
+    put(idx, LR_weight{row[0], step});
+}
+
+inline void LR::add_row(uint32_t idx, const F* delta)
+{
+  if (idx == BIAS_ROW)
+  {
+    bias += delta[0];
+    return;
+  }
+  uint32_t now = step;
+  update_fn(idx, [this, delta, now](LR_weight& weight) {
+    weight.w    = value(weight, now) + delta[0];
+    weight.step = later_step(now, weight.step);
+  });
+}
+
+inline void LR::clear()
+{
+  weights.clear();
+  hot.reset();
+  bias = 0;
+  step = 0;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,558 @@
+#ifndef FLATCTR_SHARDED_MODEL_H
+#define FLATCTR_SHARDED_MODEL_H
+
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+
+#include "spdlog/spdlog.h"
+
+#include "base_model.h"
+#include "common.h"
+#include "fm_model.h"
+#include "hash_rng.h"
+#include "stats.h"
+#include "trace.h"
+#include "worker/spsc_queue.h"
+
+// Model parallel training inside one process. Feature ids are hash partitioned over train threads
+// and each partition (shard) is written only by the thread owning it, so hot features are never
+// written by two threads at once. Forward passes read rows of any shard without locking, a row
+// being updated by its owner meanwhile is tolerated as in hogwild. Gradients of rows owned by
+// other threads are sent to the owner through one single-producer single-consumer queue per pair
+// of threads, and applied there.
+//
+// Rows are [w] for LR (k = 0) and [w, v_0, ..., v_{k-1}] for FM, stored in chunks that never
+// move. The index of a shard is an open addressing table, the owner copies it to a table twice as
+// large when it is half full and publishes the copy, so readers never see a rehash in progress. A
+// missing row reads as its initial value, which is a function of (seed, id), so every thread sees
+// the same one before the owner inserts it.
+class ShardedModel : public Base
+{
+ private:
+  static constexpr size_t CHUNK_ROWS = 4096;
+  static constexpr size_t MAX_CHUNKS = 1 << 16; // per shard
+  static constexpr size_t INIT_SLOTS = 1 << 12;
+  static constexpr size_t QUEUE_SIZE = 64;
+
+  struct Index
+  {
+    size_t                                   mask;
+    std::unique_ptr<std::atomic<uint64_t>[]> slots; // id << 32 | (row + 1), 0: empty
+
+    explicit Index(size_t size) : mask(size - 1), slots(new std::atomic<uint64_t>[size])
+    {
+      for (size_t i = 0; i < size; i++)
+        slots[i].store(0, std::memory_order_relaxed);
+    }
+  };
+
+  struct Shard
+  {
+    std::atomic<Index*>                 index;
+    std::vector<std::unique_ptr<Index>> indexes; // replaced ones are kept for late readers
+    std::unique_ptr<std::atomic<F*>[]>  chunks{new std::atomic<F*>[MAX_CHUNKS]()};
+    std::atomic<size_t>                 n_rows{0};
+    std::atomic<size_t>                 index_bytes{0};
+
+    Shard()
+    {
+      indexes.push_back(std::make_unique<Index>(INIT_SLOTS));
+      index.store(indexes.back().get());
+      index_bytes = INIT_SLOTS * sizeof(uint64_t);
+    }
+
+    ~Shard()
+    {
+      for (size_t c = 0; c < MAX_CHUNKS; c++)
+        std::free(chunks[c].load());
+    }
+  };
+
+  struct GradMsg
+  {
+    std::vector<uint32_t> ids;
+    std::vector<F>        grads; // dim per id
+  };
+
+  // state of the thread owning a shard
+  struct alignas(64) Worker
+  {
+    std::unordered_map<uint32_t, size_t>  grad_pos;
+    std::vector<uint32_t>                 grad_ids;
+    std::vector<F>                        grads;
+    std::vector<std::unique_ptr<GradMsg>> out; // per destination shard
+  };
+
+  // per call buffers of forward pass
+  struct Scratch
+  {
+    std::vector<const F*> rows;
+    std::vector<F>        init;
+    std::vector<F>        sum;
+  };
+
+  size_t N;
+  size_t n_v; // N aligned to 8
+  size_t dim; // 1 + n_v
+  size_t n_shards;
+
+  F        w_lr;
+  F        v_lr;
+  F        w_l2;
+  F        v_l2;
+  F        init_stddev;
+  uint64_t seed;
+  F        bias = 0;
+
+  typedef SPSCQueue<std::unique_ptr<GradMsg>> GradQueue;
+
+  std::vector<std::unique_ptr<Shard>>     shards;
+  std::vector<std::unique_ptr<Worker>>    workers;
+  std::vector<std::unique_ptr<GradQueue>> queues; // [from * n_shards + to]
+  std::atomic<size_t>                     n_finished{0};
+
+  static inline thread_local int     current = -1; // shard owned by the calling thread
+  static inline thread_local Scratch scratch;
+
+  [[nodiscard]] size_t shard_of(uint32_t idx) const
+  {
+    return ((uint64_t)(idx * 2654435761u) * n_shards) >> 32;
+  }
+
+  GradQueue& queue(size_t from, size_t to)
+  {
+    return *queues[from * n_shards + to];
+  }
+
+  [[nodiscard]] F* row_at(const Shard& shard, size_t r) const
+  {
+    return shard.chunks[r / CHUNK_ROWS].load(std::memory_order_acquire) + (r % CHUNK_ROWS) * dim;
+  }
+
+  F* find(const Shard& shard, uint32_t idx) const
+  {
+    const Index* index = shard.index.load(std::memory_order_acquire);
+    for (size_t h = mix64(idx) & index->mask;; h = (h + 1) & index->mask)
+    {
+      uint64_t slot = index->slots[h].load(std::memory_order_acquire);
+      if (slot == 0)
+        return nullptr;
+      if ((uint32_t)(slot >> 32) == idx)
+        return row_at(shard, (uint32_t)slot - 1);
+    }
+  }
+
+  static void place(Index* index, uint32_t idx, uint64_t slot)
+  {
+    size_t h = mix64(idx) & index->mask;
+    while (index->slots[h].load(std::memory_order_relaxed) != 0)
+      h = (h + 1) & index->mask;
+    index->slots[h].store(slot, std::memory_order_release);
+  }
+
+  void init_row(uint32_t idx, F* row) const
+  {
+    row[0] = 0;
+    for (size_t j = 0; j < n_v; j++)
+      row[1 + j] = j < N ? init_stddev * (F)hash_gauss(seed, idx, j) : 0;
+  }
+
+  // only by the owner of the shard, or while no train thread runs
+  F* insert(Shard& shard, uint32_t idx)
+  {
+    size_t r = shard.n_rows.load(std::memory_order_relaxed);
+    if (r == MAX_CHUNKS * CHUNK_ROWS) [[unlikely]]
+      return nullptr;
+    if (r % CHUNK_ROWS == 0)
+    {
+      auto* chunk = (F*)std::aligned_alloc(64, CHUNK_ROWS * dim * sizeof(F));
+      shard.chunks[r / CHUNK_ROWS].store(chunk, std::memory_order_release);
+    }
+    F* row = row_at(shard, r);
+    init_row(idx, row);
+
+    Index* index = shard.index.load(std::memory_order_relaxed);
+    if ((r + 1) * 2 > index->mask + 1)
+    {
+      auto bigger = std::make_unique<Index>((index->mask + 1) * 2);
+      for (size_t h = 0; h <= index->mask; h++)
+      {
+        uint64_t slot = index->slots[h].load(std::memory_order_relaxed);
+        if (slot != 0)
+          place(bigger.get(), (uint32_t)(slot >> 32), slot);
+      }
+      index = bigger.get();
+      shard.index_bytes += (index->mask + 1) * sizeof(uint64_t);
+      shard.indexes.push_back(std::move(bigger));
+      shard.index.store(index, std::memory_order_release);
+    }
+    place(index, idx, (uint64_t)idx << 32 | (r + 1));
+    shard.n_rows.store(r + 1, std::memory_order_release);
+    return row;
+  }
+
+  // only by the owner of the shard
+  void apply(uint32_t idx, const F* grad)
+  {
+    Shard& shard = *shards[shard_of(idx)];
+    F*     row   = find(shard, idx);
+    if (row == nullptr)
+    {
+      if (!accept_new_row() || (row = insert(shard, idx)) == nullptr)
+        return;
+      Stats::add(Stats::NEW_FEATS, 1);
+    }
+    row[0] += w_lr * grad[0];
+    for (size_t j = 1; j < dim; j++)
+      row[j] += v_lr * grad[j];
+  }
+
+  // applies gradients sent to shard s by other threads
+  void drain(size_t s)
+  {
+    std::unique_ptr<GradMsg> msg;
+    for (size_t from = 0; from < n_shards; from++)
+    {
+      if (from == s)
+        continue;
+      while (queue(from, s).pop(msg))
+        for (size_t k = 0; k < msg->ids.size(); k++)
+          apply(msg->ids[k], msg->grads.data() + k * dim);
+    }
+  }
+
+  // score before sigmoid. Rows of features are left in scratch.rows, a missing row is read as its
+  // initial value if training, and skipped (nullptr) otherwise.
+  F forward(const Sample& sample, bool training)
+  {
+    const SampleX& x = *sample.x;
+    scratch.rows.resize(x.size());
+    scratch.sum.assign(n_v, 0);
+    if (training)
+      scratch.init.resize(x.size() * dim);
+
+    F p = bias, sum_of_square = 0;
+    for (size_t f = 0; f < x.size(); f++)
+    {
+      auto& [i, xi] = x[f];
+      const F* row  = find(*shards[shard_of(i)], i);
+      if (row == nullptr && training)
+      {
+        init_row(i, scratch.init.data() + f * dim);
+        row = scratch.init.data() + f * dim;
+      }
+      scratch.rows[f] = row;
+      if (row == nullptr)
+        continue;
+      p += row[0] * xi;
+      for (size_t j = 0; j < n_v; j++)
+      {
+        F vx = row[1 + j] * xi;
+        scratch.sum[j] += vx;
+        sum_of_square += vx * vx;
+      }
+    }
+    for (size_t j = 0; j < n_v; j++)
+      p += 0.5f * scratch.sum[j] * scratch.sum[j];
+    Stats::add(Stats::LOOKUPS, x.size());
+    return p - 0.5f * sum_of_square;
+  }
+
+ public:
+  // k = 0 for LR
+  ShardedModel(size_t k, size_t n_shards, F w_lr, F v_lr, F w_l2, F v_l2, F init_stddev,
+               long seed)
+  : N(k), n_shards(n_shards), w_lr(w_lr), v_lr(v_lr), w_l2(w_l2), v_l2(v_l2),
+    init_stddev(init_stddev)
+  {
+    n_v        = k == 0 ? 0 : ((k - 1) / 8 + 1) * 8;
+    dim        = 1 + n_v;
+    this->seed = seed != -1 ? (uint64_t)seed : std::random_device()();
+    for (size_t s = 0; s < n_shards; s++)
+    {
+      shards.push_back(std::make_unique<Shard>());
+      workers.push_back(std::make_unique<Worker>());
+      workers[s]->out.resize(n_shards);
+    }
+    for (size_t q = 0; q < n_shards * n_shards; q++)
+      queues.push_back(std::make_unique<GradQueue>(QUEUE_SIZE));
+  }
+
+  void start_threads(size_t n) override
+  {
+    if (n != n_shards)
+    {
+      spdlog::error("sharded model of {} shards trained by {} threads", n_shards, n);
+      exit(-1);
+    }
+    n_finished = 0;
+  }
+
+  void thread_begin(size_t id) override
+  {
+    current = (int)id;
+  }
+
+  // Gradients may still arrive after the calling thread ran out of samples, so it keeps draining
+  // its queues until every thread has sent all of its gradients.
+  void thread_end() override
+  {
+    n_finished.fetch_add(1, std::memory_order_acq_rel);
+    while (n_finished.load(std::memory_order_acquire) < n_shards)
+    {
+      drain(current);
+      std::this_thread::yield();
+    }
+    drain(current);
+
+    // every thread is past its last forward pass, nobody reads replaced indexes any more
+    Shard& shard = *shards[current];
+    for (size_t k = 0; k + 1 < shard.indexes.size(); k++)
+      shard.index_bytes -= (shard.indexes[k]->mask + 1) * sizeof(uint64_t);
+    shard.indexes.erase(shard.indexes.begin(), shard.indexes.end() - 1);
+    current = -1;
+  }
+
+  void learn(const std::vector<std::unique_ptr<Sample>>& sample_batch) override
+  {
+    if (current < 0) [[unlikely]]
+    {
+      spdlog::error("sharded model is trained by a thread without shard");
+      exit(-1);
+    }
+    Worker& w         = *workers[current];
+    auto    size      = (F)sample_batch.size();
+    F       bias_grad = 0;
+    for (auto& sample : sample_batch)
+    {
+      F p = sigmoid(forward(*sample, true));
+      F t = (F)sample->y - p;
+      bias_grad += t / size;
+
+      const SampleX& x = *sample->x;
+      for (size_t f = 0; f < x.size(); f++)
+      {
+        auto& [i, xi]       = x[f];
+        const F* row        = scratch.rows[f];
+        auto [it, inserted] = w.grad_pos.try_emplace(i, w.grad_ids.size());
+        if (inserted)
+        {
+          w.grad_ids.push_back(i);
+          w.grads.resize(w.grads.size() + dim, 0);
+        }
+        F* grad = w.grads.data() + it->second * dim;
+        grad[0] += (t * xi - w_l2 * row[0]) / size;
+        for (size_t j = 0; j < n_v; j++)
+        {
+          F v = row[1 + j];
+          grad[1 + j] += (t * (xi * scratch.sum[j] - xi * xi * v) - v_l2 * v) / size;
+        }
+      }
+    }
+
+    {
+      TraceSpan span("sgd");
+      for (size_t k = 0; k < w.grad_ids.size(); k++)
+      {
+        uint32_t idx = w.grad_ids[k];
+        size_t   s   = shard_of(idx);
+        if (s == (size_t)current)
+        {
+          apply(idx, w.grads.data() + k * dim);
+          continue;
+        }
+        if (w.out[s] == nullptr)
+          w.out[s] = std::make_unique<GradMsg>();
+        w.out[s]->ids.push_back(idx);
+        w.out[s]->grads.insert(w.out[s]->grads.end(), w.grads.begin() + k * dim,
+                               w.grads.begin() + (k + 1) * dim);
+      }
+      Stats::add(Stats::UPDATES, w.grad_ids.size());
+      for (size_t s = 0; s < n_shards; s++)
+      {
+        if (w.out[s] == nullptr)
+          continue;
+        while (!queue(current, s).push(w.out[s])) // full, the receiver may be waiting on us
+          drain(current);
+        w.out[s] = nullptr;
+      }
+      drain(current);
+    }
+    w.grad_pos.clear();
+    w.grad_ids.clear();
+    w.grads.clear();
+
+    bias += w_lr * bias_grad;
+  }
+
+  F predict_prob(const std::unique_ptr<Sample>& sample) override
+  {
+    return calibrate(sigmoid(forward(*sample, false)));
+  }
+
+  size_t load(const std::string& fname) override
+  {
+    std::ifstream::sync_with_stdio(false);
+    std::ifstream ifs;
+    ifs.open(fname, std::ifstream::in);
+
+    std::string                   line;
+    std::vector<std::string>      tokens;
+    char*                         endptr;
+    fast_float::from_chars_result answer{};
+    size_t                        k = 0;
+
+    if (!load_neg_rate(ifs))
+      return 0;
+    if (N > 0)
+    {
+      next_tokens(ifs, line, tokens);
+      check_line(line, tokens, 2);
+      parse_idx(line, tokens[1].c_str(), k);
+      if (tokens[0] != "k" || k != N)
+      {
+        spdlog::error("model parse error. @k, model has k = {}", N);
+        return 0;
+      }
+    }
+    next_tokens(ifs, line, tokens);
+    check_line(line, tokens, 2);
+    if (tokens[0] != "bias")
+    {
+      spdlog::error("model parse error. @bias");
+      return 0;
+    }
+    parse_val(line, tokens[1].c_str(), bias);
+
+    uint32_t idx;
+    F        val;
+    size_t   n_rows = 0;
+    while (next_tokens(ifs, line, tokens))
+    {
+      check_line(line, tokens, N + 2);
+      parse_idx(line, tokens[0].c_str(), idx);
+      Shard& shard = *shards[shard_of(idx)];
+      F*     row   = find(shard, idx);
+      if (row == nullptr && (row = insert(shard, idx)) == nullptr)
+        return 0;
+      for (size_t j = 0; j <= N; j++)
+      {
+        parse_val(line, tokens[j + 1].c_str(), val);
+        row[j] = val;
+      }
+      n_rows++;
+    }
+    ifs.close();
+    return n_rows;
+  }
+
+  int save(const std::string& fname) override
+  {
+    std::ofstream::sync_with_stdio(false);
+    std::ofstream ofs;
+    ofs.open(fname, std::ofstream::out);
+    save_neg_rate(ofs);
+    if (N > 0)
+      ofs << "k\t" << N << std::endl;
+    ofs << "bias\t" << bias << std::endl;
+    for (auto& shard : shards)
+    {
+      const Index* index = shard->index.load();
+      for (size_t h = 0; h <= index->mask; h++)
+      {
+        uint64_t slot = index->slots[h].load(std::memory_order_relaxed);
+        if (slot == 0)
+          continue;
+        const F* row = row_at(*shard, (uint32_t)slot - 1);
+        ofs << (slot >> 32);
+        for (size_t j = 0; j <= N; j++)
+          ofs << "\t" << row[j];
+        ofs << std::endl;
+      }
+    }
+    ofs.close();
+    return 0;
+  }
+
+  MemInfo mem_info() override
+  {
+    MemInfo info;
+    size_t  slots = 0;
+    for (auto& shard : shards)
+    {
+      size_t rows = shard->n_rows.load(std::memory_order_relaxed);
+      info.rows += rows;
+      info.table_bytes += shard->index_bytes.load(std::memory_order_relaxed);
+      info.heap_bytes += (rows + CHUNK_ROWS - 1) / CHUNK_ROWS * CHUNK_ROWS * dim * sizeof(F);
+      slots += shard->index.load(std::memory_order_relaxed)->mask + 1;
+    }
+    info.load_factor = (double)info.rows / (double)slots;
+    return info;
+  }
+
+  // rows never move, so they are not erased, the memory budget only refuses new rows
+  size_t evict(size_t) override
+  {
+    return 0;
+  }
+
+  size_t row_dim() override
+  {
+    return 1 + N;
+  }
+
+  // Row access below is not synchronized, it is for use while no train thread runs.
+  bool get_row(uint32_t idx, F* row, bool create) override
+  {
+    if (idx == BIAS_ROW)
+    {
+      row[0] = bias;
+      std::fill(row + 1, row + 1 + N, 0);
+      return true;
+    }
+    Shard&   shard = *shards[shard_of(idx)];
+    const F* r     = find(shard, idx);
+    if (r == nullptr && (!create || !accept_new_row() || (r = insert(shard, idx)) == nullptr))
+      return false;
+    std::copy(r, r + 1 + N, row);
+    return true;
+  }
+
+  void set_row(uint32_t idx, const F* row) override
+  {
+    if (idx == BIAS_ROW)
+    {
+      bias = row[0];
+      return;
+    }
+    Shard& shard = *shards[shard_of(idx)];
+    F*     r     = find(shard, idx);
+    if (r != nullptr || (r = insert(shard, idx)) != nullptr)
+      std::copy(row, row + 1 + N, r);
+  }
+
+  void add_row(uint32_t idx, const F* delta) override
+  {
+    if (idx == BIAS_ROW)
+    {
+      bias += delta[0];
+      return;
+    }
+    F* r = find(*shards[shard_of(idx)], idx);
+    if (r != nullptr)
+      for (size_t j = 0; j <= N; j++)
+        r[j] += delta[j];
+  }
+
+  void clear() override
+  {
+    for (auto& shard : shards)
+      shard = std::make_unique<Shard>();
+    bias = 0;
+  }
+};
+
+#endif //FLATCTR_SHARDED_MODEL_H
@@ -0,0 +1,36 @@
+#ifndef FLATCTR_SCORER_H
+#define FLATCTR_SCORER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// In-process scoring API of libflatctr, it depends only on the standard library. Rows are passed
+// as CSR arrays: row r has features ids[offsets[r]], ..., ids[offsets[r + 1] - 1] with values at
+// the same positions of vals, so offsets has n_rows + 1 entries.
+class Scorer
+{
+ public:
+  // loads a model saved by flatctr, lr or fm is detected from the file, and so is fname.vocab of
+  // a model trained on dense ids, nullptr if it fails
+  static std::unique_ptr<Scorer> load(const std::string& fname);
+
+  ~Scorer();
+
+  // writes probabilities of rows to probs, safe to call from any num of threads at once
+  void score(size_t n_rows, const uint32_t* ids, const float* vals, const uint64_t* offsets,
+             float* probs) const;
+
+  // rows of the model, excluding bias
+  [[nodiscard]] size_t num_features() const;
+
+ private:
+  struct Impl;
+
+  std::unique_ptr<Impl> impl;
+
+  explicit Scorer(std::unique_ptr<Impl> impl);
+};
+
+#endif //FLATCTR_SCORER_H
@@ -0,0 +1,259 @@
+#ifndef FLATCTR_STATS_H
+#define FLATCTR_STATS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "spdlog/spdlog.h"
+
+// Per-thread hot-path counters. Each thread only writes its own cache line with relaxed
+// load+store, the reporter thread reads them with relaxed loads, so no locked instruction is on
+// the hot path. Everything is a no-op unless Stats::enabled is set before threads start.
+class Stats
+{
+ public:
+  enum Counter
+  {
+    SAMPLES,      // samples learned
+    NNZ,          // features of learned samples
+    LINES,        // lines split by reader
+    READ_NS,      // time of reader in read()
+    PUSH_WAIT_NS, // time blocked in BlockingQueue::push
+    PUSH_WAITS,
+    POP_WAIT_NS, // time blocked in BlockingQueue::pop
+    POP_WAITS,
+    PARSE_NS,  // time of Sample parsing
+    BAD_LINES, // malformed lines skipped
+    LEARN_NS,  // time of model learning
+    LOOKUPS,   // weight table lookups
+    UPDATES,   // weight table writes
+    NEW_FEATS,
+    INSERT_RACES, // new feature already inserted by another thread between find and insert
+    N_COUNTERS
+  };
+
+  static constexpr const char* names[N_COUNTERS] = {
+    "samples",     "nnz",      "lines",     "read_ns",  "push_wait_ns", "push_waits", "pop_wait_ns",
+    "pop_waits",   "parse_ns", "bad_lines", "learn_ns", "lookups",      "updates",    "new_feats",
+    "insert_races"};
+
+  struct alignas(64) ThreadStats
+  {
+    std::atomic<uint64_t> c[N_COUNTERS]{};
+  };
+
+  static inline bool enabled = false;
+
+  static void add(Counter counter, uint64_t v)
+  {
+    if (enabled) [[unlikely]]
+    {
+      std::atomic<uint64_t>& a = local()->c[counter];
+      a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+    }
+  }
+
+  static uint64_t now_ns()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+  }
+
+  // threads with the same name share counters, so per-epoch train threads accumulate
+  static void set_thread_name(const std::string& name)
+  {
+    std::lock_guard<std::mutex> lck(mtx);
+    std::unique_ptr<ThreadStats>& ts = registry[name];
+    if (ts == nullptr)
+      ts = std::make_unique<ThreadStats>();
+    current = ts.get();
+  }
+
+  // name -> counters of each registered thread
+  static std::map<std::string, std::array<uint64_t, N_COUNTERS>> snapshot()
+  {
+    std::map<std::string, std::array<uint64_t, N_COUNTERS>> res;
+    std::lock_guard<std::mutex>                             lck(mtx);
+    for (auto& [name, ts] : registry)
+      for (size_t i = 0; i < N_COUNTERS; i++)
+        res[name][i] = ts->c[i].load(std::memory_order_relaxed);
+    return res;
+  }
+
+ private:
+  static inline std::mutex                                          mtx;
+  static inline std::map<std::string, std::unique_ptr<ThreadStats>> registry;
+  static inline thread_local ThreadStats*                           current = nullptr;
+
+  static ThreadStats* local()
+  {
+    if (current == nullptr) [[unlikely]]
+    {
+      std::stringstream ss;
+      ss << "thread_" << std::this_thread::get_id();
+      set_thread_name(ss.str());
+    }
+    return current;
+  }
+};
+
+// adds the lifetime of the scope to a time counter
+class StatTimer
+{
+ private:
+  Stats::Counter counter;
+  uint64_t       begin = 0;
+
+ public:
+  explicit StatTimer(Stats::Counter counter) : counter(counter)
+  {
+    if (Stats::enabled) [[unlikely]]
+      begin = Stats::now_ns();
+  }
+
+  ~StatTimer()
+  {
+    if (Stats::enabled) [[unlikely]]
+      Stats::add(counter, Stats::now_ns() - begin);
+  }
+};
+
+// Logs aggregated rates every interval, and optionally dumps all counters to a file, in JSON if
+// the file name ends with ".json", otherwise in Prometheus text format.
+class StatsReporter
+{
+ private:
+  using Snapshot = std::map<std::string, std::array<uint64_t, Stats::N_COUNTERS>>;
+
+  double                  interval;
+  std::string             file_name;
+  std::thread             th;
+  std::mutex              mtx;
+  std::condition_variable cv;
+  bool                    stopped = false;
+  Snapshot                last;
+  uint64_t                last_ns = 0;
+
+  static bool is_train_thread(const std::string& name)
+  {
+    return name.rfind("train_", 0) == 0;
+  }
+
+  void report()
+  {
+    Snapshot snap = Stats::snapshot();
+    uint64_t now  = Stats::now_ns();
+    double   secs = (double)(now - last_ns) / 1e9;
+
+    std::array<uint64_t, Stats::N_COUNTERS> train{}, reader{};
+    size_t                                  n_train = 0;
+    for (auto& [name, c] : snap)
+    {
+      const auto& prev  = last[name];
+      bool        is_tr = is_train_thread(name);
+      n_train += is_tr;
+      for (size_t i = 0; i < Stats::N_COUNTERS; i++)
+        (is_tr ? train : reader)[i] += c[i] - prev[i];
+    }
+
+    auto rate = [secs](uint64_t v) { return (double)v / secs; };
+    auto pct  = [secs](uint64_t ns, size_t n) { return n ? ns / 1e7 / secs / (double)n : 0.; };
+    spdlog::info("stats: {:.0f} samples/s, {:.0f} nnz/s | reader: {:.0f} lines/s, io {:.1f}%, "
+                 "push_wait {:.1f}% | train x{}: parse {:.1f}%, learn {:.1f}%, pop_wait {:.1f}% "
+                 "| {:.0f} lookups/s, {:.0f} updates/s, {:.0f} new_feats/s, {} insert_races",
+                 rate(train[Stats::SAMPLES]), rate(train[Stats::NNZ]), rate(reader[Stats::LINES]),
+                 pct(reader[Stats::READ_NS], 1), pct(reader[Stats::PUSH_WAIT_NS], 1), n_train,
+                 pct(train[Stats::PARSE_NS], n_train), pct(train[Stats::LEARN_NS], n_train),
+                 pct(train[Stats::POP_WAIT_NS], n_train), rate(train[Stats::LOOKUPS]),
+                 rate(train[Stats::UPDATES]), rate(train[Stats::NEW_FEATS]),
+                 train[Stats::INSERT_RACES]);
+
+    if (!file_name.empty())
+      dump(snap);
+    last    = std::move(snap);
+    last_ns = now;
+  }
+
+  void dump(const Snapshot& snap)
+  {
+    bool        json = file_name.size() >= 5 && file_name.substr(file_name.size() - 5) == ".json";
+    std::string tmp  = file_name + ".tmp";
+    FILE*       fp   = fopen(tmp.c_str(), "w");
+    if (fp == nullptr)
+    {
+      spdlog::error("can not open stats file {}", tmp);
+      return;
+    }
+    if (json)
+    {
+      fprintf(fp, "{\"timestamp_ns\": %lu, \"threads\": {", Stats::now_ns());
+      bool first = true;
+      for (auto& [name, c] : snap)
+      {
+        fprintf(fp, "%s\n  \"%s\": {", first ? "" : ",", name.c_str());
+        for (size_t i = 0; i < Stats::N_COUNTERS; i++)
+          fprintf(fp, "%s\"%s\": %lu", i ? ", " : "", Stats::names[i], c[i]);
+        fprintf(fp, "}");
+        first = false;
+      }
+      fprintf(fp, "\n}}\n");
+    }
+    else
+    {
+      for (size_t i = 0; i < Stats::N_COUNTERS; i++)
+      {
+        fprintf(fp, "# TYPE flatctr_%s_total counter\n", Stats::names[i]);
+        for (auto& [name, c] : snap)
+          fprintf(fp, "flatctr_%s_total{thread=\"%s\"} %lu\n", Stats::names[i], name.c_str(),
+                  c[i]);
+      }
+    }
+    fclose(fp);
+    rename(tmp.c_str(), file_name.c_str());
+  }
+
+  void loop()
+  {
+    std::unique_lock<std::mutex> lck(mtx);
+    while (!cv.wait_for(lck, std::chrono::duration<double>(interval), [this] { return stopped; }))
+      report();
+    report();
+  }
+
+ public:
+  StatsReporter(double interval, std::string file_name)
+  : interval(interval), file_name(std::move(file_name))
+  {
+  }
+
+  void start()
+  {
+    last_ns = Stats::now_ns();
+    th      = std::thread(&StatsReporter::loop, this);
+    pthread_setname_np(th.native_handle(), "stats");
+  }
+
+  void stop()
+  {
+    {
+      std::lock_guard<std::mutex> lck(mtx);
+      stopped = true;
+    }
+    cv.notify_one();
+    if (th.joinable())
+      th.join();
+  }
+};
+
+#endif //FLATCTR_STATS_H
@@ -0,0 +1,140 @@
+#ifndef FLATCTR_TRACE_H
+#define FLATCTR_TRACE_H
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+// Timeline of scoped spans in Chrome trace-event format, viewable in Perfetto or chrome://tracing.
+// Each thread appends to its own buffer without locking, buffers are exported after all threads
+// joined. Everything is a no-op unless Trace::enabled is set before threads start.
+class Trace
+{
+ public:
+  struct Event
+  {
+    const char* name;
+    uint64_t    begin_ns;
+    uint64_t    dur_ns;
+  };
+
+  struct ThreadBuffer
+  {
+    uint32_t           tid;
+    std::vector<Event> events;
+    size_t             dropped = 0;
+  };
+
+  static constexpr size_t MAX_EVENTS_PER_THREAD = 1 << 22;
+
+  static inline bool enabled = false;
+
+  static uint64_t now_ns()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+  }
+
+  // threads with the same name share a track, so per-epoch train threads line up
+  static void set_thread_name(const std::string& name)
+  {
+    if (!enabled)
+      return;
+    std::lock_guard<std::mutex>    lck(mtx);
+    std::unique_ptr<ThreadBuffer>& buf = buffers[name];
+    if (buf == nullptr)
+    {
+      buf      = std::make_unique<ThreadBuffer>();
+      buf->tid = buffers.size();
+      buf->events.reserve(1 << 16);
+    }
+    current = buf.get();
+  }
+
+  static void record(const char* name, uint64_t begin_ns, uint64_t end_ns)
+  {
+    if (current == nullptr) [[unlikely]]
+      set_thread_name("thread_" + std::to_string(pthread_self()));
+    if (current->events.size() >= MAX_EVENTS_PER_THREAD) [[unlikely]]
+    {
+      current->dropped++;
+      return;
+    }
+    current->events.push_back({name, begin_ns, end_ns - begin_ns});
+  }
+
+  static void start()
+  {
+    enabled  = true;
+    begin_ns = now_ns();
+  }
+
+  // call after all traced threads joined
+  static int save(const std::string& file_name)
+  {
+    FILE* fp = fopen(file_name.c_str(), "w");
+    if (fp == nullptr)
+    {
+      spdlog::error("can not open trace file {}", file_name);
+      return -1;
+    }
+    std::lock_guard<std::mutex> lck(mtx);
+    size_t                      n_events = 0, n_dropped = 0;
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(fp, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+                "\"args\": {\"name\": \"flatctr\"}}");
+    for (auto& [name, buf] : buffers)
+    {
+      fprintf(fp, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, "
+                  "\"args\": {\"name\": \"%s\"}}",
+              buf->tid, name.c_str());
+      for (const Event& e : buf->events)
+        fprintf(fp, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, "
+                    "\"ts\": %.3f, \"dur\": %.3f}",
+                e.name, buf->tid, (double)(e.begin_ns - begin_ns) / 1e3, (double)e.dur_ns / 1e3);
+      n_events += buf->events.size();
+      n_dropped += buf->dropped;
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    spdlog::info("trace: {} events saved to {}, {} dropped", n_events, file_name, n_dropped);
+    return 0;
+  }
+
+ private:
+  static inline std::mutex                                           mtx;
+  static inline std::map<std::string, std::unique_ptr<ThreadBuffer>> buffers;
+  static inline thread_local ThreadBuffer*                           current  = nullptr;
+  static inline uint64_t                                             begin_ns = 0;
+};
+
+// records the lifetime of the scope as a span, name must be a string literal
+class TraceSpan
+{
+ private:
+  const char* name;
+  uint64_t    begin = 0;
+
+ public:
+  explicit TraceSpan(const char* name) : name(name)
+  {
+    if (Trace::enabled) [[unlikely]]
+      begin = Trace::now_ns();
+  }
+
+  ~TraceSpan()
+  {
+    if (Trace::enabled) [[unlikely]]
+      Trace::record(name, begin, Trace::now_ns());
+  }
+};
+
+#endif //FLATCTR_TRACE_H
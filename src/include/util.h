@@ -6,7 +6,7 @@
 
 #include "common.h"
 
-void string_split(const string& s, vector<string>& tokens, const string& delimiter)
+inline void string_split(const string& s, vector<string>& tokens, const string& delimiter)
 {
   string::size_type last_pos = s.find_first_not_of(delimiter, 0);
   string::size_type pos      = s.find_first_of(delimiter, last_pos);
@@ -0,0 +1,35 @@
+#ifndef FLATCTR_BARRIER_H
+#define FLATCTR_BARRIER_H
+
+#include <condition_variable>
+#include <mutex>
+
+// Reusable barrier of n threads, wait() returns when all n threads have called it.
+class Barrier
+{
+ private:
+  std::mutex              mtx;
+  std::condition_variable all_arrived;
+  size_t                  n;
+  size_t                  n_waiting  = 0;
+  size_t                  generation = 0;
+
+ public:
+  explicit Barrier(size_t n) : n(n) {}
+
+  void wait()
+  {
+    std::unique_lock<std::mutex> lck(mtx);
+    size_t                       gen = generation;
+    if (++n_waiting == n)
+    {
+      n_waiting = 0;
+      generation++;
+      all_arrived.notify_all();
+      return;
+    }
+    all_arrived.wait(lck, [this, gen] { return gen != generation; });
+  }
+};
+
+#endif //FLATCTR_BARRIER_H
@@ -4,6 +4,9 @@
 #include <condition_variable>
 #include <deque>
 
+#include "stats.h"
+#include "trace.h"
+
 using namespace std;
 
 template <typename T>
@@ -22,8 +25,14 @@ class BlockingQueue
   void push(T&& t)
   {
     unique_lock<mutex> lck(mtx);
-    while (queue.size() > n)
-      not_full.wait(lck);
+    if (queue.size() > n)
+    {
+      StatTimer timer(Stats::PUSH_WAIT_NS);
+      TraceSpan span("push_wait");
+      Stats::add(Stats::PUSH_WAITS, 1);
+      while (queue.size() > n)
+        not_full.wait(lck);
+    }
     queue.push_back(std::move(t));
     not_empty.notify_one();
     lck.unlock();
@@ -32,8 +41,14 @@ class BlockingQueue
   void pop(T& t)
   {
     unique_lock<mutex> lck(mtx);
-    while (queue.empty())
-      not_empty.wait(lck);
+    if (queue.empty())
+    {
+      StatTimer timer(Stats::POP_WAIT_NS);
+      TraceSpan span("pop_wait");
+      Stats::add(Stats::POP_WAITS, 1);
+      while (queue.empty())
+        not_empty.wait(lck);
+    }
     t = std::move(queue.front());
     queue.pop_front();
     not_full.notify_one();
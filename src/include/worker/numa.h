@@ -0,0 +1,159 @@
+#ifndef FLATCTR_NUMA_H
+#define FLATCTR_NUMA_H
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+// NUMA placement by raw syscalls, so there is no dependency on libnuma. Everything falls back to
+// plain allocation and no pinning when Numa::enabled is not set or the kernel refuses.
+class Numa
+{
+ private:
+  static constexpr int MPOL_PREFERRED_  = 1;
+  static constexpr int MPOL_INTERLEAVE_ = 3;
+
+  static inline std::vector<int>              node_ids; // nodes with cpus
+  static inline std::vector<std::vector<int>> node_cpus;
+
+  // parses cpulist like "0-3,8-11"
+  static std::vector<int> parse_cpulist(const std::string& s)
+  {
+    std::vector<int> cpus;
+    size_t           pos = 0;
+    while (pos < s.size())
+    {
+      size_t end = s.find(',', pos);
+      if (end == std::string::npos)
+        end = s.size();
+      std::string range = s.substr(pos, end - pos);
+      size_t      dash  = range.find('-');
+      int         lo    = std::stoi(range);
+      int         hi    = dash == std::string::npos ? lo : std::stoi(range.substr(dash + 1));
+      for (int c = lo; c <= hi; c++)
+        cpus.push_back(c);
+      pos = end + 1;
+    }
+    return cpus;
+  }
+
+  static std::vector<unsigned long> node_mask(const std::vector<int>& nodes)
+  {
+    std::vector<unsigned long> mask(*std::max_element(nodes.begin(), nodes.end()) / 64 + 2, 0);
+    for (int node : nodes)
+      mask[node / 64] |= 1UL << (node % 64);
+    return mask;
+  }
+
+ public:
+  static inline bool enabled = false;
+
+  // reads topology from sysfs, cpus outside the affinity mask of the process are skipped, and so
+  // are nodes without cpus
+  static void init()
+  {
+    enabled = true;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    node_ids.clear();
+    node_cpus.clear();
+    for (int node = 0;; node++)
+    {
+      std::ifstream ifs("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+      if (!ifs)
+        break;
+      std::string line;
+      std::getline(ifs, line);
+      std::vector<int> cpus;
+      for (int c : parse_cpulist(line))
+        if (CPU_ISSET(c, &allowed))
+          cpus.push_back(c);
+      if (cpus.empty())
+        continue;
+      node_ids.push_back(node);
+      node_cpus.push_back(cpus);
+    }
+    if (node_cpus.empty())
+    {
+      node_ids.push_back(0);
+      node_cpus.emplace_back();
+      for (int c = 0; c < CPU_SETSIZE; c++)
+        if (CPU_ISSET(c, &allowed))
+          node_cpus[0].push_back(c);
+    }
+    for (size_t n = 0; n < node_cpus.size(); n++)
+      spdlog::info("numa node {}: {} cpus", node_ids[n], node_cpus[n].size());
+  }
+
+  // Reader (slot 0) goes to the first cpu of the first node, trainers are spread round-robin over
+  // nodes, so each socket gets the same share of trainers.
+  static void pin_thread(pthread_t th, size_t slot)
+  {
+    if (!enabled)
+      return;
+    size_t                  node = slot % node_cpus.size();
+    const std::vector<int>& cpus = node_cpus[node];
+    int                     cpu  = cpus[(slot / node_cpus.size()) % cpus.size()];
+    cpu_set_t               set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(th, sizeof(set), &set) != 0)
+      spdlog::warn("can not pin thread to cpu {}", cpu);
+  }
+
+  // interleaves pages allocated later by the calling thread over all nodes, used by train
+  // threads, whose inserts grow the weight tables
+  static void interleave_thread()
+  {
+    if (!enabled || node_ids.size() < 2)
+      return;
+    std::vector<unsigned long> mask = node_mask(node_ids);
+    if (syscall(SYS_set_mempolicy, MPOL_INTERLEAVE_, mask.data(), mask.size() * 64) != 0)
+      spdlog::warn("set_mempolicy interleave failed");
+  }
+
+  static int current_node()
+  {
+    int cpu = sched_getcpu();
+    for (size_t n = 0; n < node_cpus.size(); n++)
+      for (int c : node_cpus[n])
+        if (c == cpu)
+          return node_ids[n];
+    return node_ids[0];
+  }
+
+  // Page aligned buffer, on the node of the calling thread if enabled. mbind on the range is
+  // applied before first touch, so pages land on the node regardless of which thread touches them.
+  static char* alloc(size_t size)
+  {
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      return nullptr;
+    if (enabled && node_ids.size() > 1)
+    {
+      int                        node = current_node();
+      std::vector<unsigned long> mask = node_mask({node});
+      if (syscall(SYS_mbind, p, size, MPOL_PREFERRED_, mask.data(), mask.size() * 64, 0) != 0)
+        spdlog::warn("mbind to node {} failed", node);
+    }
+    return (char*)p;
+  }
+
+  static void free(char* p, size_t size)
+  {
+    if (p != nullptr)
+      munmap(p, size);
+  }
+};
+
+#endif //FLATCTR_NUMA_H
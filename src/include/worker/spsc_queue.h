@@ -0,0 +1,52 @@
+#ifndef FLATCTR_SPSC_QUEUE_H
+#define FLATCTR_SPSC_QUEUE_H
+
+#include <atomic>
+#include <vector>
+
+// Bounded lock-free ring for exactly one producer thread and one consumer thread. push and pop
+// never block, they return false when the ring is full or empty.
+template <typename T>
+class SPSCQueue
+{
+ private:
+  std::vector<T> ring;
+  size_t         mask;
+
+  alignas(64) std::atomic<size_t> head{0}; // written by consumer
+  alignas(64) std::atomic<size_t> tail{0}; // written by producer
+
+ public:
+  // n is rounded up to a power of 2
+  explicit SPSCQueue(size_t n)
+  {
+    size_t size = 1;
+    while (size < n)
+      size *= 2;
+    ring.resize(size);
+    mask = size - 1;
+  }
+
+  // t is moved from only if pushed
+  bool push(T& t)
+  {
+    size_t tl = tail.load(std::memory_order_relaxed);
+    if (tl - head.load(std::memory_order_acquire) == ring.size())
+      return false;
+    ring[tl & mask] = std::move(t);
+    tail.store(tl + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T& t)
+  {
+    size_t hd = head.load(std::memory_order_relaxed);
+    if (hd == tail.load(std::memory_order_acquire))
+      return false;
+    t = std::move(ring[hd & mask]);
+    head.store(hd + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+#endif //FLATCTR_SPSC_QUEUE_H
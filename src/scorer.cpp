@@ -0,0 +1,81 @@
+#include <fstream>
+
+#include "spdlog/spdlog.h"
+
+#include "model/fm_model.h"
+#include "model/lr_model.h"
+#include "scorer.h"
+
+struct Scorer::Impl
+{
+  std::unique_ptr<Base>  model;
+  std::unique_ptr<Vocab> vocab; // of a model trained on dense ids
+  size_t                 n_features = 0;
+};
+
+Scorer::Scorer(std::unique_ptr<Impl> impl) : impl(std::move(impl)) {}
+
+Scorer::~Scorer() = default;
+
+std::unique_ptr<Scorer> Scorer::load(const std::string& fname)
+{
+  std::ifstream ifs(fname);
+  std::string   key;
+  double        neg_rate;
+  long          k = 0;
+  if (!(ifs >> key) || (key == "neg_sample_rate" && !(ifs >> neg_rate >> key)))
+  {
+    spdlog::error("can not read model {}", fname);
+    return nullptr;
+  }
+  // fm models start with "k\t<k>", lr models with "bias\t<bias>", after neg_sample_rate if any
+  if (key == "k" && !(ifs >> k && k > 0))
+  {
+    spdlog::error("model parse error. @k");
+    return nullptr;
+  }
+  ifs.close();
+
+  auto impl = std::make_unique<Impl>();
+  if (k > 0)
+    impl->model = std::make_unique<FM>(k, 0, 0, 0, 0, 0, 0);
+  else
+    impl->model = std::make_unique<LR>(0, 0);
+  if (std::ifstream(fname + ".vocab").good())
+  {
+    impl->vocab = std::make_unique<Vocab>();
+    if (!impl->vocab->load(fname + ".vocab"))
+      return nullptr;
+    impl->model->set_dense_rows(impl->vocab->rows());
+  }
+  impl->n_features = impl->model->load(fname);
+  if (impl->n_features == 0)
+  {
+    spdlog::error("error loading model {}", fname);
+    return nullptr;
+  }
+  return std::unique_ptr<Scorer>(new Scorer(std::move(impl)));
+}
+
+void Scorer::score(size_t n_rows, const uint32_t* ids, const float* vals, const uint64_t* offsets,
+                   float* probs) const
+{
+  // reused by each thread, so a warm thread scores without allocation
+  static thread_local std::unique_ptr<Sample> sample =
+    std::make_unique<Sample>(0, std::make_unique<SampleX>());
+
+  SampleX&     x     = *sample->x;
+  const Vocab* vocab = impl->vocab.get();
+  for (size_t r = 0; r < n_rows; r++)
+  {
+    x.clear();
+    for (uint64_t j = offsets[r]; j < offsets[r + 1]; j++)
+      x.emplace_back(vocab != nullptr ? vocab->map(ids[j]) : ids[j], vals[j]);
+    probs[r] = impl->model->predict_prob(sample);
+  }
+}
+
+size_t Scorer::num_features() const
+{
+  return impl->n_features;
+}
@@ -0,0 +1,313 @@
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "cxxopts.hpp"
+#include "spdlog/spdlog.h"
+
+#include "common.h"
+#include "hash_rng.h"
+
+using namespace std;
+
+#define CONST_FEATURE 2147483547u
+
+struct GenConfig
+{
+  string   out;
+  uint64_t rows;
+  uint32_t nnz;
+  uint32_t id_space;
+  double   zipf;
+  double   ctr;
+  double   weight_stddev;
+  long     seed;
+  long     model_seed;
+} gcfg;
+
+// Rejection-inversion sampler for Zipf(n, s) over ranks [1, n], O(1) per draw.
+// W. Hormann and G. Derflinger, "Rejection-inversion to generate variates from monotone
+// discrete distributions", 1996.
+class ZipfSampler
+{
+ private:
+  double n;
+  double s;
+  double h_integral_x1;
+  double h_integral_n;
+  double s_val;
+
+  static double helper1(double x)
+  {
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+  }
+
+  static double helper2(double x)
+  {
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x * (1.0 / 3) * (1 + 0.25 * x));
+  }
+
+  [[nodiscard]] double h(double x) const
+  {
+    return exp(-s * log(x));
+  }
+
+  [[nodiscard]] double h_integral(double x) const
+  {
+    double log_x = log(x);
+    return helper2((1 - s) * log_x) * log_x;
+  }
+
+  [[nodiscard]] double h_integral_inverse(double x) const
+  {
+    double t = x * (1 - s);
+    if (t < -1)
+      t = -1;
+    return exp(helper1(t) * x);
+  }
+
+ public:
+  ZipfSampler(uint64_t n, double s) : n((double)n), s(s)
+  {
+    h_integral_x1 = h_integral(1.5) - 1;
+    h_integral_n  = h_integral(this->n + 0.5);
+    s_val         = 2 - h_integral_inverse(h_integral(2.5) - h(2));
+  }
+
+  template <typename RNG>
+  uint64_t operator()(RNG& rng)
+  {
+    uniform_real_distribution<double> uniform(0, 1);
+    while (true)
+    {
+      double u = h_integral_n + uniform(rng) * (h_integral_x1 - h_integral_n);
+      double x = h_integral_inverse(u);
+      double k = floor(x + 0.5);
+      if (k < 1)
+        k = 1;
+      else if (k > n)
+        k = n;
+      if (k - x <= s_val || u >= h_integral(k + 0.5) - h(k))
+        return (uint64_t)k;
+    }
+  }
+};
+
+// Bijection from Zipf rank to feature id, so that hot ids are scattered over the id space
+// instead of being the smallest ones.
+class IdScrambler
+{
+ private:
+  uint64_t mask = 1;
+  uint64_t mul;
+  uint64_t add;
+  uint64_t n;
+
+ public:
+  IdScrambler(uint64_t n, uint64_t seed) : n(n)
+  {
+    while (mask < n)
+      mask <<= 1;
+    mask -= 1;
+    mul = mix64(seed) | 1;
+    add = mix64(seed + 1);
+  }
+
+  [[nodiscard]] uint32_t operator()(uint64_t rank) const
+  {
+    uint64_t x = rank - 1;
+    do
+    {
+      x = (x * mul + add) & mask;
+    } while (x >= n); // cycle-walking keeps the mapping a bijection on [0, n)
+    return (uint32_t)x;
+  }
+};
+
+// Hidden ground-truth weight of a feature, so that labels carry learnable signal.
+inline double hidden_weight(uint32_t id)
+{
+  return gcfg.weight_stddev * hash_gauss(gcfg.model_seed, id, 0);
+}
+
+class RowGenerator
+{
+ private:
+  mt19937_64                         rng;
+  ZipfSampler                        zipf;
+  IdScrambler                        scrambler;
+  normal_distribution<double>        nnz_dist;
+  uniform_int_distribution<uint32_t> val_dist{1, 10000};
+
+ public:
+  vector<pair<uint32_t, F>> x;
+
+  explicit RowGenerator(uint64_t seed)
+  : rng(seed), zipf(gcfg.id_space, gcfg.zipf), scrambler(gcfg.id_space, gcfg.model_seed),
+    nnz_dist(gcfg.nnz, gcfg.nnz * 0.25)
+  {
+  }
+
+  // fills x with a sorted, duplicate-free row and returns its hidden logit without bias
+  double next()
+  {
+    long nnz = lround(nnz_dist(rng));
+    nnz      = max(1L, min(nnz, (long)gcfg.id_space));
+    x.clear();
+    for (long tries = 0; (long)x.size() < nnz && tries < nnz * 8; tries++)
+    {
+      uint32_t id = scrambler(zipf(rng));
+      if (any_of(x.begin(), x.end(), [id](const pair<uint32_t, F>& e) { return e.first == id; }))
+        continue;
+      x.emplace_back(id, (F)val_dist(rng) / 10000);
+    }
+    sort(x.begin(), x.end());
+    double logit = 0;
+    for (auto& [id, val] : x)
+      logit += hidden_weight(id) * val;
+    return logit / sqrt((double)x.size());
+  }
+
+  double uniform()
+  {
+    return uniform_real_distribution<double>(0, 1)(rng);
+  }
+};
+
+inline double sigmoid(double t)
+{
+  return 1 / (1 + exp(-t));
+}
+
+// find the bias that makes the expected CTR match the requested one
+double calibrate_bias()
+{
+  RowGenerator   gen(mix64(gcfg.seed) ^ 0x5bd1e995);
+  vector<double> logits(20000);
+  for (auto& l : logits)
+    l = gen.next();
+  double lo = -30, hi = 30;
+  for (int iter = 0; iter < 100; iter++)
+  {
+    double mid = (lo + hi) / 2, ctr = 0;
+    for (double l : logits)
+      ctr += sigmoid(mid + l);
+    ctr /= (double)logits.size();
+    if (ctr < gcfg.ctr)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return (lo + hi) / 2;
+}
+
+int generate()
+{
+  FILE* fp = fopen(gcfg.out.c_str(), "w");
+  if (fp == nullptr)
+  {
+    spdlog::error("can not open {}", gcfg.out);
+    return -1;
+  }
+
+  double       bias = calibrate_bias();
+  RowGenerator gen(gcfg.seed);
+  vector<char> buf(1 << 22);
+  char*        p         = buf.data();
+  char*        buf_end   = buf.data() + buf.size();
+  uint64_t     positives = 0, total_nnz = 0;
+  for (uint64_t r = 0; r < gcfg.rows; r++)
+  {
+    double logit = gen.next();
+    int    y     = gen.uniform() < sigmoid(bias + logit);
+    positives += y;
+    total_nnz += gen.x.size() + 1;
+
+    if (buf_end - p < (long)(gen.x.size() + 2) * 24)
+    {
+      fwrite(buf.data(), 1, p - buf.data(), fp);
+      p = buf.data();
+    }
+    *p++ = (char)('0' + y);
+    for (auto& [id, val] : gen.x)
+    {
+      *p++ = ' ';
+      p    = to_chars(p, buf_end, id).ptr;
+      *p++ = ':';
+      p    = to_chars(p, buf_end, val).ptr;
+    }
+    p += sprintf(p, " %u:1.0\n", CONST_FEATURE);
+
+    if ((r + 1) % 1000000 == 0) [[unlikely]]
+      spdlog::info("{:12d} rows", r + 1);
+  }
+  fwrite(buf.data(), 1, p - buf.data(), fp);
+  fclose(fp);
+  spdlog::info("wrote {} rows to {}, ctr: {:.4f}, avg nnz: {:.2f}", gcfg.rows, gcfg.out,
+               (double)positives / (double)gcfg.rows, (double)total_nnz / (double)gcfg.rows);
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  cxxopts::Options options(argv[0], "\nSynthetic CTR data generator, writes libsvm format.\n");
+  options.set_tab_expansion().set_width(150);
+  string group;
+  options.add_option(group, "o", "out", "output file",
+                     cxxopts::value<std::string>()->default_value("../dataset/synthetic.txt"), "");
+  options.add_option(group, "n", "rows", "num of rows",
+                     cxxopts::value<uint64_t>()->default_value("1000000"), "");
+  options.add_option(group, "", "nnz", "mean num of features per row",
+                     cxxopts::value<uint32_t>()->default_value("40"), "");
+  options.add_option(group, "", "ids", "size of feature id space",
+                     cxxopts::value<uint32_t>()->default_value("100000000"), "");
+  options.add_option(group, "", "zipf", "exponent of Zipfian feature id distribution",
+                     cxxopts::value<double>()->default_value("1.1"), "");
+  options.add_option(group, "", "ctr", "expected ratio of positive samples",
+                     cxxopts::value<double>()->default_value("0.1"), "");
+  options.add_option(group, "", "weight_stddev", "stddev of hidden feature weights",
+                     cxxopts::value<double>()->default_value("2"), "");
+  options.add_option(group, "", "seed", "random seed of rows",
+                     cxxopts::value<long>()->default_value("1"), "");
+  options.add_option(group, "", "model_seed",
+                     "random seed of hidden weights, keep it fixed across train/valid/test files",
+                     cxxopts::value<long>()->default_value("1"), "");
+  options.add_options()("h,help", "printing this help message");
+
+  try
+  {
+    auto args = options.parse(argc, argv);
+    if (args.count("help"))
+    {
+      std::cout << options.help() << std::endl;
+      exit(0);
+    }
+
+    gcfg.out           = args["out"].as<string>();
+    gcfg.rows          = args["rows"].as<uint64_t>();
+    gcfg.nnz           = args["nnz"].as<uint32_t>();
+    gcfg.id_space      = args["ids"].as<uint32_t>();
+    gcfg.zipf          = args["zipf"].as<double>();
+    gcfg.ctr           = args["ctr"].as<double>();
+    gcfg.weight_stddev = args["weight_stddev"].as<double>();
+    gcfg.seed          = args["seed"].as<long>();
+    gcfg.model_seed    = args["model_seed"].as<long>();
+  } catch (cxxopts::exceptions::exception& exception)
+  {
+    cerr << "error parsing args: " << exception.what() << std::endl;
+    exit(-1);
+  }
+
+  if (gcfg.nnz == 0 || gcfg.id_space == 0 || gcfg.id_space > CONST_FEATURE || gcfg.zipf <= 0
+      || gcfg.ctr <= 0 || gcfg.ctr >= 1)
+  {
+    cerr << "invalid args\n";
+    exit(-1);
+  }
+
+  return generate();
+}